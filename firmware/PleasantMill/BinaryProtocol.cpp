@@ -0,0 +1,228 @@
+/************
+ * Binary Motion Protocol
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#include "BinaryProtocol.h"
+#include "MachineModel.h"
+#include "hostcom.h"
+
+extern long lastLineNrRecieved;	// in process_g_code.cpp
+extern byte SendDebug;
+
+BinaryProtocol binaryProtocol;
+
+static uint16_t crc16(const byte* data, byte length, uint16_t crc)
+{
+	while(length--)
+	{
+		crc ^= (uint16_t)(*data++) << 8;
+		for(byte i=0; i<8; i++)
+			crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+	return crc;
+}
+
+BinaryProtocol::BinaryProtocol()
+{
+	on = false;
+	inFrame = false;
+	pending = false;
+	sentFrames = 0;
+}
+
+// M903 S1: The frames start where the machine is now
+void BinaryProtocol::begin()
+{
+	steps = to_steps(sharedMachineModel.returnUnits(), sharedMachineModel.localPosition+sharedMachineModel.localZeroOffset);
+	feed = sharedMachineModel.localPosition.f;
+	inFrame = false;
+	pending = false;
+	on = true;
+}
+
+void BinaryProtocol::end()
+{
+	on = false;
+	pending = false;
+}
+
+// The number of bytes of the frame in the buffer, 0 = not known yet
+byte BinaryProtocol::frameLength()
+{
+	switch(frame[0])
+	{
+		case kFrameEnd:
+			return 4;
+		case kFrameMove:
+			if(count < 3)
+				return 0;
+			{
+				byte length = 5;
+				for(byte axis=0; axis<5; axis++)
+					if(frame[2] & (1<<axis))
+						length += 2;
+				if(frame[2] & BIN_FEED_FOLLOWS)
+					length += 4;
+				return length;
+			}
+		default:
+			return 1;	// Unknown type, fails below
+	}
+}
+
+void BinaryProtocol::reject(const char* why)
+{
+	if(SendDebug & DEBUG_ERRORS)
+		sprintf(talkToHost.string(), "Binary Error: %s", why);
+	talkToHost.setResend(lastLineNrRecieved+1);
+	talkToHost.sendMessage(SendDebug & DEBUG_ERRORS);
+}
+
+// Check the frame, acknowledge it and decode it
+void BinaryProtocol::frameComplete()
+{
+	if(count < 4 || crc16(frame, count-2, 0xFFFF) != (frame[count-2] | ((uint16_t)frame[count-1] << 8)))
+	{
+		reject("bad frame");
+		return;
+	}
+	if(frame[1] != (byte)(lastLineNrRecieved+1))
+	{
+		reject("frame out of sequence");
+		return;
+	}
+	if(sharedMachineModel.emergencyStop || !sharedMachineModel.receiving)
+	{
+		reject("machine is not armed");
+		return;
+	}
+	lastLineNrRecieved++;
+	talkToHost.setAckLine(lastLineNrRecieved);
+	talkToHost.sendMessage(false);
+
+	if(frame[0] == kFrameEnd)
+	{
+		end();
+		return;
+	}
+
+	byte mask = frame[2];
+	byte i = 3;
+	long* axis[5] = { &steps.x, &steps.y, &steps.z, &steps.a, &steps.b };
+	for(byte a=0; a<5; a++)
+		if(mask & (1<<a))
+		{
+			*axis[a] += (int16_t)(frame[i] | (frame[i+1] << 8));
+			i += 2;
+		}
+	if(mask & BIN_FEED_FOLLOWS)
+		memcpy(&feed, frame+i, sizeof(float));
+
+	target = from_steps(sharedMachineModel.returnUnits(), steps) - sharedMachineModel.localZeroOffset;
+	target.f = feed;
+	targetLine = lastLineNrRecieved;
+	pending = true;
+}
+
+// Called instead of reading text lines. Like a command, a move which doesn't fit into
+// the queue is kept and the following frames wait in the receive buffer.
+void BinaryProtocol::receive()
+{
+	if(pending)
+	{
+		if(sharedMachineModel.qFull())
+		{
+			talkToHost.flushAck();	// Not reading on, so don't keep the host waiting
+			return;
+		}
+		sharedMachineModel.currentLine = targetLine;
+		sharedMachineModel.qMove(target);
+		pending = false;
+	}
+
+	while(on && !pending && talkToHost.gotData())
+	{
+		byte c = talkToHost.get();
+		if(c == BIN_STX)
+		{
+			inFrame = true;
+			escaped = false;
+			count = 0;
+			continue;
+		}
+		if(!inFrame)
+			continue;	// Noise between the frames
+		if(c == BIN_DLE)
+		{
+			escaped = true;
+			continue;
+		}
+		if(escaped)
+		{
+			c ^= BIN_ESCAPE;
+			escaped = false;
+		}
+		if(count >= BIN_MAX_FRAME)
+		{
+			inFrame = false;
+			reject("frame too long");
+			continue;
+		}
+		frame[count++] = c;
+		if(count == frameLength())
+		{
+			inFrame = false;
+			frameComplete();
+		}
+	}
+
+	if(pending && !sharedMachineModel.qFull())
+	{
+		sharedMachineModel.currentLine = targetLine;
+		sharedMachineModel.qMove(target);
+		pending = false;
+	}
+}
+
+static void putStuffed(byte c)
+{
+	if(c == BIN_STX || c == BIN_DLE)
+	{
+		talkToHost.putRaw(BIN_DLE);
+		c ^= BIN_ESCAPE;
+	}
+	talkToHost.putRaw(c);
+}
+
+// A frame to the host
+void BinaryProtocol::sendFrame(byte type, const byte* payload, byte length)
+{
+	byte header[2] = { type, sentFrames++ };
+	uint16_t crc = crc16(header, 2, 0xFFFF);
+	crc = crc16(payload, length, crc);
+	talkToHost.putRaw(BIN_STX);
+	putStuffed(header[0]);
+	putStuffed(header[1]);
+	for(byte i=0; i<length; i++)
+		putStuffed(payload[i]);
+	putStuffed(crc & 0xFF);
+	putStuffed(crc >> 8);
+}
@@ -0,0 +1,118 @@
+/************
+ * Binary Motion Protocol
+ *
+ * After M903 S1 the host sends packed move frames instead of G-code lines.
+ * Each frame is acknowledged like a line (ok or rs), its sequence number
+ * continues the line numbers of the text protocol. An end frame switches
+ * back to text.
+ *
+ * Frame:  STX type seq payload crc_lo crc_hi
+ *
+ * The CRC (CCITT, polynomial 0x1021, start value 0xFFFF) covers type, seq
+ * and payload. seq is the low byte of the line number (last + 1).
+ * After the STX, the bytes STX, DLE and the real-time commands (see
+ * HostSerial.h) are sent as DLE followed by the byte XOR 0x20.
+ *
+ * Move payload:  mask [dx] [dy] [dz] [da] [db] [feed]
+ *   Bits 0..4 of the mask say which axes move, each of them follows as a
+ *   signed 16 bit step delta (little endian). With bit 7 set, a new feedrate
+ *   follows as a float (units per minute, little endian). 
+ * End payload:   none
+ *
+ * M905 S<Hz> makes the firmware send telemetry frames to the host (same
+ * framing, only STX and DLE are escaped, seq counts the frames). They
+ * come between the response lines, a host which turns them on has to
+ * look for the STX. The payload is struct Telemetry below (little endian).
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#ifndef BINARYPROTOCOL_H
+#define BINARYPROTOCOL_H
+
+#include "Arduino.h"
+#include "configuration.h"
+#include "vectors.h"
+
+#define BIN_STX		0x02
+#define BIN_DLE		0x10
+#define BIN_ESCAPE	0x20
+
+// Frame types
+enum {
+	kFrameMove = 1,
+	kFrameEnd = 2,
+	kFrameTelemetry = 0x81		// Firmware to host
+};
+
+// Telemetry state bits
+enum {
+	kTelemetryHold = 1<<0,
+	kTelemetryRunning = 1<<1,
+	kTelemetryIndexing = 1<<2
+};
+
+struct Telemetry
+{
+	long steps[5];		// X, Y, Z, A, B, absolute steps as they're made
+	long line;			// Line number of the running block, -1 = none
+	float feed;			// Of the running move, units per minute
+	byte queued;		// Blocks in the motion queue
+	byte received;		// Characters in the receive buffer
+	byte endstops;		// Endstop hits (X_LOW_HIT, ...)
+	byte state;			// kTelemetry...
+};
+
+#define BIN_FEED_FOLLOWS 0x80
+#define MAX_TELEMETRY_RATE 50	// Frames per second
+#define BIN_MAX_FRAME 20
+
+class BinaryProtocol
+{
+private:
+	bool on;
+	bool inFrame;
+	bool escaped;
+	byte frame[BIN_MAX_FRAME];
+	byte count;
+
+	LongPoint steps;		// Where the frames so far end, absolute steps
+	float feed;
+	bool pending;			// The last move waits for room in the queue
+	FloatPoint target;
+	long targetLine;
+	byte sentFrames;
+
+	byte frameLength();
+	void frameComplete();
+	void reject(const char* why);
+
+public:
+	BinaryProtocol();
+
+	void begin();
+	void end();
+	bool active() { return on; }
+	void receive();
+	void sendFrame(byte type, const byte* payload, byte length);
+};
+
+extern BinaryProtocol binaryProtocol;
+
+#endif
@@ -0,0 +1,373 @@
+/************
+ * Cutter Radius Compensation
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#include "CutterCompensation.h"
+#include "MachineModel.h"
+#include "Spindle.h"
+
+// Corners flatter than this (cosine of the angle between the moves) get a miter instead of an arc
+#define COMP_MITER_LIMIT 0.985
+#define COMP_MIN_MOVE 0.0001
+// flush() stops this many radii short of the end of the pending move: the intersection of
+// an inside corner up to COMP_MITER_LIMIT lies less than sqrt((1+l)/(1-l)) radii back
+#define COMP_FLUSH_SETBACK 11.6
+
+CutterCompensation::CutterCompensation()
+{
+	side = 0;
+	radius = 0.;
+	exiting = false;
+	havePending = false;
+	heldCount = 0;
+	haveLastDir = false;
+}
+
+void CutterCompensation::start(int compensationSide, float toolRadius)
+{
+	programmed = sharedMachineModel.localPosition;
+	side = compensationSide;
+	radius = toolRadius;
+	exiting = false;
+	havePending = false;
+	heldCount = 0;
+	haveLastDir = false;
+	sharedMachineModel.setCutterRadiusCompensation(side);
+}
+
+// G40 (and the program end): Finish the pending move on the offset path. The next
+// move goes from there to its programmed target.
+void CutterCompensation::stop()
+{
+	if(side == 0)
+		return;
+	finish();
+	side = 0;
+	exiting = true;
+	haveLastDir = false;
+	sharedMachineModel.setCutterRadiusCompensation(0);
+}
+
+// Soft reset: forget the held back moves, nothing is queued
+void CutterCompensation::cancel()
+{
+	side = 0;
+	exiting = false;
+	havePending = false;
+	heldCount = 0;
+	haveLastDir = false;
+	sharedMachineModel.setCutterRadiusCompensation(0);
+}
+
+FloatPoint& CutterCompensation::position()
+{
+	if(active())
+		return programmed;
+	return sharedMachineModel.localPosition;
+}
+
+// The offset direction for a move in the direction dir
+void CutterCompensation::normal(float dirX, float dirY, float& nX, float& nY)
+{
+	if(side < 0)	// left
+	{
+		nX = -dirY;
+		nY = dirX;
+	}
+	else
+	{
+		nX = dirY;
+		nY = -dirX;
+	}
+}
+
+// Queue the programmed target with the compensated XY position
+void CutterCompensation::emit(const FloatPoint& target, float x, float y, bool rapid)
+{
+	FloatPoint p = target;
+	p.x = x;
+	p.y = y;
+	sharedMachineModel.qMove(p, rapid);
+}
+
+// Queue what's held back after the pending move, its moves at x, y. True if Z (or A, B) moved.
+bool CutterCompensation::emitHeld(float x, float y)
+{
+	bool moved = false;
+	for(byte i=0; i<heldCount; i++)
+	{
+		HeldBlock& h = held[i];
+		switch(h.kind)
+		{
+			case kHeldMove:
+				emit(h.target, x, y, h.code);
+				moved = true;
+				break;
+			case kHeldDwell:
+				sharedMachineModel.qDwell((unsigned long)h.value);
+				break;
+			case kHeldSpindle:
+				if(h.code == kSpindleOff)
+					spindle.stop();
+				else
+					spindle.start(h.code);
+				break;
+			case kHeldSpindleSpeed:
+				spindle.setSpeed(h.value);
+				break;
+			default:
+				sharedMachineModel.qOutput(h.code, h.kind == kHeldOutputOn);
+				break;
+		}
+	}
+	heldCount = 0;
+	return moved;
+}
+
+// A free slot behind the pending move. When there's none left the pending move is flushed.
+HeldBlock& CutterCompensation::hold(byte kind)
+{
+	if(heldCount == COMP_LOOKAHEAD)
+		flush();
+	HeldBlock& h = held[heldCount++];
+	h.kind = kind;
+	return h;
+}
+
+// G4: the moves before the dwell finish first, so it waits behind the pending move
+void CutterCompensation::dwell(unsigned long milliseconds)
+{
+	if(!havePending)
+	{
+		sharedMachineModel.qDwell(milliseconds);
+		return;
+	}
+	hold(kHeldDwell).value = milliseconds;
+}
+
+// M62/M63: switch with the start of the next programmed move. While a move is
+// held back, that's after it (and after the Z-only moves before the M-code).
+void CutterCompensation::output(byte output, bool on)
+{
+	if(!havePending)
+	{
+		sharedMachineModel.qOutput(output, on);
+		return;
+	}
+	hold(on ? kHeldOutputOn : kHeldOutputOff).code = output;
+}
+
+// M3/M4/M5 and S: the spindle's sync block and its spin-up dwell belong behind the pending move
+void CutterCompensation::spindleStart(byte direction)
+{
+	if(!havePending)
+	{
+		if(direction == kSpindleOff)
+			spindle.stop();
+		else
+			spindle.start(direction);
+		return;
+	}
+	hold(kHeldSpindle).code = direction;
+}
+
+void CutterCompensation::spindleSpeed(float rpm)
+{
+	if(!havePending)
+	{
+		spindle.setSpeed(rpm);
+		return;
+	}
+	hold(kHeldSpindleSpeed).value = rpm;
+}
+
+// Join the incoming and the outgoing move at the programmed vertex. If the incoming
+// move has already been queued (after finish()) it ended perpendicular to the vertex, at an
+// inside corner the tool goes back along it to the intersection.
+// Returns false for an inside reversal, the incoming move ends at its offset point then.
+bool CutterCompensation::corner(const FloatPoint& vertex, float inX, float inY, float outX, float outY, bool incomingQueued, bool rapid)
+{
+	float inNX, inNY, outNX, outNY;
+	normal(inX, inY, inNX, inNY);
+	normal(outX, outY, outNX, outNY);
+
+	float dot = inX*outX + inY*outY;
+	float cross = inX*outY - inY*outX;
+	bool inside = (cross*side < 0.);
+
+	if(inside && dot <= -COMP_MITER_LIMIT)
+	{
+		// The outgoing move turns back into the material, the tool doesn't fit
+		float x = vertex.x + radius*inNX;
+		float y = vertex.y + radius*inNY;
+		if(!incomingQueued)
+			emit(vertex, x, y, pendingRapid);
+		emitHeld(x, y);
+		return false;
+	}
+
+	if(dot >= COMP_MITER_LIMIT || (inside && dot > -COMP_MITER_LIMIT))
+	{
+		// Intersection of both offset lines
+		float f = radius/(1. + dot);
+		float x = vertex.x + f*(inNX + outNX);
+		float y = vertex.y + f*(inNY + outNY);
+		emit(vertex, x, y, pendingRapid);
+		emitHeld(x, y);
+		return true;
+	}
+
+	// Outside corner (or reversal): arc around the programmed vertex
+	float x = vertex.x + radius*inNX;
+	float y = vertex.y + radius*inNY;
+	if(!incomingQueued)
+		emit(vertex, x, y, pendingRapid);
+	emitHeld(x, y);
+
+	float startAngle = atan2(inNY, inNX);
+	float angle;
+	if(dot <= -COMP_MITER_LIMIT)
+		angle = (side < 0) ? -M_PI : M_PI;	// Around the end of the move
+	else
+		angle = atan2(inNX*outNY - inNY*outNX, inNX*outNX + inNY*outNY);
+
+	// Same segmentation as drawArc()
+	int steps = (int)ceil(max(fabs(angle) * 2.4, radius * fabs(angle)));
+	for(int s = 1; s <= steps; s++)
+	{
+		float a = startAngle + angle*((float)s/steps);
+		emit(vertex, vertex.x + radius*cos(a), vertex.y + radius*sin(a), rapid);
+	}
+	return true;
+}
+
+bool CutterCompensation::move(const FloatPoint& target, bool rapid)
+{
+	if(side == 0)
+	{
+		// The move after G40 (or compensation not active at all)
+		exiting = false;
+		sharedMachineModel.qMove(target, rapid);
+		return true;
+	}
+
+	float dx = target.x - programmed.x;
+	float dy = target.y - programmed.y;
+	float length = sqrt(dx*dx + dy*dy);
+	if(length < COMP_MIN_MOVE)
+	{
+		// No XY movement: keep the offset
+		if(havePending)
+		{
+			HeldBlock& h = hold(kHeldMove);
+			h.target = target;
+			h.code = rapid;
+		}
+		else
+			emit(target, sharedMachineModel.localPosition.x, sharedMachineModel.localPosition.y, rapid);
+		programmed = target;
+		return true;
+	}
+
+	dx /= length;
+	dy /= length;
+	bool fits = true;
+	if(havePending)
+		fits = corner(pendingEnd, pendingDirX, pendingDirY, dx, dy, false, rapid);
+	else if(haveLastDir)
+		fits = corner(programmed, lastDirX, lastDirY, dx, dy, true, rapid);
+	// else: the first move after G41/G42 ramps onto the offset path
+	if(!fits)
+	{
+		// Stay at the vertex, as after finish()
+		if(havePending)
+		{
+			lastDirX = pendingDirX;
+			lastDirY = pendingDirY;
+		}
+		havePending = false;
+		haveLastDir = true;
+		return false;
+	}
+
+	havePending = true;
+	haveLastDir = false;
+	pendingEnd = target;
+	pendingDirX = dx;
+	pendingDirY = dy;
+	pendingRapid = rapid;
+	programmed = target;
+	return true;
+}
+
+// The queue has to run empty (M0, M6, ...), but the next move isn't known yet. Queue the
+// pending move only up to COMP_FLUSH_SETBACK radii before its perpendicular end (not back
+// beyond where it started), no inside corner reaches back that far. The held blocks run
+// there, the rest of the move is queued with the next corner.
+void CutterCompensation::flush()
+{
+	if(!havePending)
+		return;
+
+	float nX, nY;
+	normal(pendingDirX, pendingDirY, nX, nY);
+	float x = pendingEnd.x + radius*nX;
+	float y = pendingEnd.y + radius*nY;
+	FloatPoint from = sharedMachineModel.localPosition;
+	float along = (x-from.x)*pendingDirX + (y-from.y)*pendingDirY;
+	float back = min(COMP_FLUSH_SETBACK*radius, max(along, 0.));
+	if(along - back > COMP_MIN_MOVE)
+	{
+		// Z, A and B in proportion
+		float t = (along - back)/along;
+		FloatPoint p = pendingEnd;
+		p.z = from.z + (pendingEnd.z-from.z)*t;
+		p.a = from.a + (pendingEnd.a-from.a)*t;
+		p.b = from.b + (pendingEnd.b-from.b)*t;
+		emit(p, x - back*pendingDirX, y - back*pendingDirY, pendingRapid);
+	}
+	if(emitHeld(sharedMachineModel.localPosition.x, sharedMachineModel.localPosition.y))
+	{
+		// The rest of the move follows at the height the held moves have left
+		pendingEnd.z = sharedMachineModel.localPosition.z;
+		pendingEnd.a = sharedMachineModel.localPosition.a;
+		pendingEnd.b = sharedMachineModel.localPosition.b;
+	}
+}
+
+// Queue the pending move, ending perpendicular to its programmed end
+void CutterCompensation::finish()
+{
+	if(!havePending)
+		return;
+
+	float nX, nY;
+	normal(pendingDirX, pendingDirY, nX, nY);
+	float x = pendingEnd.x + radius*nX;
+	float y = pendingEnd.y + radius*nY;
+	emit(pendingEnd, x, y, pendingRapid);
+	emitHeld(x, y);
+
+	havePending = false;
+	haveLastDir = true;
+	lastDirX = pendingDirX;
+	lastDirY = pendingDirY;
+}
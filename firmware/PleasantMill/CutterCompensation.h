@@ -0,0 +1,108 @@
+/************
+ * Cutter Radius Compensation
+ *
+ * G41/G42 offset the programmed XY path by the radius of the tool, so the
+ * cutting edge (and not the center of the tool) follows the contour.
+ * Each move is held back until the next XY move is known, then the corner
+ * between the two is calculated: inside corners end at the intersection of
+ * the offset lines, outside corners get an arc around the programmed corner.
+ * An inside reversal would gouge: the tool stops at the offset point and the
+ * move is refused.
+ * Z-only moves, dwells, spindle changes and the output switches of M62/M63 in
+ * between are held back as well (up to COMP_LOOKAHEAD). When the queue has to run empty, flush()
+ * queues the pending move only as far as no corner can reach back; G40 and the
+ * program end finish it.
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#ifndef CUTTERCOMPENSATION_H
+#define CUTTERCOMPENSATION_H
+
+#include "Arduino.h"
+#include "configuration.h"
+#include "vectors.h"
+
+// What's held back after the pending move
+enum {
+	kHeldMove,			// A Z-only move
+	kHeldDwell,			// G4
+	kHeldOutputOn,		// M62
+	kHeldOutputOff,		// M63
+	kHeldSpindle,		// M3/M4/M5
+	kHeldSpindleSpeed	// S
+};
+
+struct HeldBlock
+{
+	byte kind;
+	byte code;			// kHeldMove: rapid, kHeldOutputOn/Off: the output, kHeldSpindle: the direction
+	float value;		// kHeldDwell: milliseconds, kHeldSpindleSpeed: rpm
+	FloatPoint target;	// kHeldMove
+};
+
+class CutterCompensation
+{
+private:
+	int side;					// Like MachineModel::cutterRadiusCompensation: 1 = right of path; -1 = left of path
+	float radius;
+	bool exiting;				// After G40 until the next move, which leaves the offset path
+
+	FloatPoint programmed;		// Programmed (uncompensated) position, in local coordinates
+
+	bool havePending;			// The last XY move, not yet (completely) queued
+	FloatPoint pendingEnd;
+	float pendingDirX;			// Unit vector of the pending move
+	float pendingDirY;
+	bool pendingRapid;			// Queued by rapidMove(): the laser stays dark
+
+	HeldBlock held[COMP_LOOKAHEAD];	// After the pending move
+	byte heldCount;
+
+	bool haveLastDir;			// Direction of the last queued XY move after a flush()
+	float lastDirX;
+	float lastDirY;
+
+	void normal(float dirX, float dirY, float& nX, float& nY);
+	void emit(const FloatPoint& target, float x, float y, bool rapid);
+	bool emitHeld(float x, float y);
+	HeldBlock& hold(byte kind);
+	bool corner(const FloatPoint& vertex, float inX, float inY, float outX, float outY, bool incomingQueued, bool rapid);
+
+public:
+	CutterCompensation();
+
+	void start(int compensationSide, float toolRadius);
+	void stop();
+	void cancel();
+	bool move(const FloatPoint& target, bool rapid = false);	// false if the tool doesn't fit (the move is skipped)
+	void flush();
+	void finish();
+	void dwell(unsigned long milliseconds);	// G4
+	void output(byte output, bool on);	// M62/M63
+	void spindleStart(byte direction);	// M3/M4/M5 (kSpindleOff)
+	void spindleSpeed(float rpm);		// S
+
+	bool active() { return side!=0 || exiting; }
+
+	// The programmed position while compensation is active, the machine's local position otherwise
+	FloatPoint& position();
+};
+
+#endif
@@ -0,0 +1,357 @@
+/************
+ * Parameters and Expressions
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#include "Expression.h"
+
+float parameters[NUM_PARAMETERS];
+float probeResult[5];		// #5061..#5065
+bool probeSuccess = false;	// #5070
+const char* expressionError = "";
+
+#define DEG_TO_RADIANS (M_PI/180.)
+
+// Precedence levels of the binary operators
+enum {
+	kLevelLogical,
+	kLevelRelational,
+	kLevelAdditive,
+	kLevelMultiplicative,
+	kLevelPower,
+	kLevelValue
+};
+
+enum {
+	kOpNone,
+	kOpAnd, kOpOr, kOpXor,
+	kOpEq, kOpNe, kOpGt, kOpGe, kOpLt, kOpLe,
+	kOpPlus, kOpMinus,
+	kOpTimes, kOpDivide, kOpMod,
+	kOpPower
+};
+
+struct Operator
+{
+	const char* name;
+	byte level;
+	byte op;
+};
+
+// Longer names first where one starts with the other
+static const Operator kOperators[] = {
+	{ "AND", kLevelLogical, kOpAnd },
+	{ "OR", kLevelLogical, kOpOr },
+	{ "XOR", kLevelLogical, kOpXor },
+	{ "EQ", kLevelRelational, kOpEq },
+	{ "NE", kLevelRelational, kOpNe },
+	{ "GT", kLevelRelational, kOpGt },
+	{ "GE", kLevelRelational, kOpGe },
+	{ "LT", kLevelRelational, kOpLt },
+	{ "LE", kLevelRelational, kOpLe },
+	{ "+", kLevelAdditive, kOpPlus },
+	{ "-", kLevelAdditive, kOpMinus },
+	{ "**", kLevelPower, kOpPower },
+	{ "*", kLevelMultiplicative, kOpTimes },
+	{ "/", kLevelMultiplicative, kOpDivide },
+	{ "MOD", kLevelMultiplicative, kOpMod }
+};
+
+enum {
+	kFnAbs, kFnAcos, kFnAsin, kFnAtan, kFnCos, kFnExp, kFnFix, kFnFup,
+	kFnLn, kFnRound, kFnSin, kFnSqrt, kFnTan, kFnCount
+};
+
+static const char* const kFunctions[kFnCount] = {
+	"ABS", "ACOS", "ASIN", "ATAN", "COS", "EXP", "FIX", "FUP",
+	"LN", "ROUND", "SIN", "SQRT", "TAN"
+};
+
+static bool readExpression(const char*& p, float& value, byte level);
+
+static void skipSpaces(const char*& p)
+{
+	while(*p == ' ')
+		p++;
+}
+
+static bool startsWith(const char* p, const char* word)
+{
+	return strncmp(p, word, strlen(word)) == 0;
+}
+
+bool setParameter(int n, float value)
+{
+	if(n < 1 || n >= NUM_PARAMETERS)
+	{
+		expressionError = "bad parameter number";
+		return false;
+	}
+	parameters[n] = value;
+	return true;
+}
+
+void setProbeResult(const FloatPoint& p, bool success)
+{
+	probeResult[0] = p.x;
+	probeResult[1] = p.y;
+	probeResult[2] = p.z;
+	probeResult[3] = p.a;
+	probeResult[4] = p.b;
+	probeSuccess = success;
+}
+
+static bool readNumber(const char*& p, float& value)
+{
+	long mantissa = 0;
+	float scale = 1.;
+	bool digits = false;
+	bool point = false;
+	for(;; p++)
+	{
+		if(*p >= '0' && *p <= '9')
+		{
+			if(mantissa < 100000000L)	// Beyond float precision anyway
+			{
+				mantissa = mantissa*10 + (*p-'0');
+				if(point)
+					scale *= .1;
+			}
+			else if(!point)
+				scale *= 10.;
+			digits = true;
+		}
+		else if(*p == '.' && !point)
+			point = true;
+		else
+			break;
+	}
+	value = mantissa*scale;
+	if(!digits)
+		expressionError = "number expected";
+	return digits;
+}
+
+// [expression]
+static bool readBracket(const char*& p, float& value)
+{
+	skipSpaces(p);
+	if(*p != '[')
+	{
+		expressionError = "[ expected";
+		return false;
+	}
+	p++;
+	if(!readExpression(p, value, kLevelLogical))
+		return false;
+	skipSpaces(p);
+	if(*p != ']')
+	{
+		expressionError = "] expected";
+		return false;
+	}
+	p++;
+	return true;
+}
+
+static bool readFunction(const char*& p, float& value)
+{
+	byte fn;
+	for(fn=0; fn<kFnCount; fn++)
+		if(startsWith(p, kFunctions[fn]))
+			break;
+	if(fn == kFnCount)
+	{
+		expressionError = "unknown function";
+		return false;
+	}
+	p += strlen(kFunctions[fn]);
+	
+	float arg;
+	if(!readBracket(p, arg))
+		return false;
+	switch(fn)
+	{
+		case kFnAbs:	value = fabs(arg); break;
+		case kFnAcos:	value = acos(arg)/DEG_TO_RADIANS; break;
+		case kFnAsin:	value = asin(arg)/DEG_TO_RADIANS; break;
+		case kFnAtan:
+			{
+				// ATAN[y]/[x]
+				float x;
+				skipSpaces(p);
+				if(*p != '/')
+				{
+					expressionError = "ATAN needs [y]/[x]";
+					return false;
+				}
+				p++;
+				if(!readBracket(p, x))
+					return false;
+				value = atan2(arg, x)/DEG_TO_RADIANS;
+			}
+			break;
+		case kFnCos:	value = cos(arg*DEG_TO_RADIANS); break;
+		case kFnExp:	value = exp(arg); break;
+		case kFnFix:	value = floor(arg); break;
+		case kFnFup:	value = ceil(arg); break;
+		case kFnLn:
+			if(arg <= 0.)
+			{
+				expressionError = "LN of a value <= 0";
+				return false;
+			}
+			value = log(arg);
+			break;
+		case kFnRound:	value = round(arg); break;
+		case kFnSin:	value = sin(arg*DEG_TO_RADIANS); break;
+		case kFnSqrt:
+			if(arg < 0.)
+			{
+				expressionError = "SQRT of a negative value";
+				return false;
+			}
+			value = sqrt(arg);
+			break;
+		case kFnTan:	value = tan(arg*DEG_TO_RADIANS); break;
+	}
+	return true;
+}
+
+bool readValue(const char*& p, float& value)
+{
+	skipSpaces(p);
+	if(*p == '[')
+		return readBracket(p, value);
+	if(*p == '#')
+	{
+		p++;
+		float n;
+		if(!readValue(p, n))
+			return false;
+		int i = round(n);
+		if(i >= PARAMETER_PROBE_BASE && i < PARAMETER_PROBE_BASE+5)
+		{
+			value = probeResult[i-PARAMETER_PROBE_BASE];
+			return true;
+		}
+		if(i == PARAMETER_PROBE_SUCCESS)
+		{
+			value = probeSuccess ? 1. : 0.;
+			return true;
+		}
+		if(i < 0 || i >= NUM_PARAMETERS)
+		{
+			expressionError = "bad parameter number";
+			return false;
+		}
+		value = parameters[i];
+		return true;
+	}
+	if(*p == '-' || *p == '+')
+	{
+		bool negative = (*p == '-');
+		p++;
+		if(!readValue(p, value))
+			return false;
+		if(negative)
+			value = -value;
+		return true;
+	}
+	if((*p >= '0' && *p <= '9') || *p == '.')
+		return readNumber(p, value);
+	if(*p >= 'A' && *p <= 'Z')
+		return readFunction(p, value);
+	expressionError = "value expected";
+	return false;
+}
+
+static byte readOperator(const char*& p, byte level)
+{
+	skipSpaces(p);
+	for(byte i=0; i<sizeof(kOperators)/sizeof(Operator); i++)
+	{
+		if(kOperators[i].level == level && startsWith(p, kOperators[i].name))
+		{
+			// * is not the start of **
+			if(kOperators[i].op == kOpTimes && p[1] == '*')
+				continue;
+			p += strlen(kOperators[i].name);
+			return kOperators[i].op;
+		}
+	}
+	return kOpNone;
+}
+
+static bool readExpression(const char*& p, float& value, byte level)
+{
+	if(level == kLevelValue)
+		return readValue(p, value);
+	
+	if(!readExpression(p, value, level+1))
+		return false;
+	for(;;)
+	{
+		const char* before = p;
+		byte op = readOperator(p, level);
+		if(op == kOpNone)
+		{
+			p = before;
+			return true;
+		}
+		float right;
+		if(!readExpression(p, right, level+1))
+			return false;
+		switch(op)
+		{
+			case kOpAnd:		value = (value != 0. && right != 0.); break;
+			case kOpOr:			value = (value != 0. || right != 0.); break;
+			case kOpXor:		value = ((value != 0.) != (right != 0.)); break;
+			case kOpEq:			value = (value == right); break;
+			case kOpNe:			value = (value != right); break;
+			case kOpGt:			value = (value > right); break;
+			case kOpGe:			value = (value >= right); break;
+			case kOpLt:			value = (value < right); break;
+			case kOpLe:			value = (value <= right); break;
+			case kOpPlus:		value += right; break;
+			case kOpMinus:		value -= right; break;
+			case kOpTimes:		value *= right; break;
+			case kOpDivide:
+				if(right == 0.)
+				{
+					expressionError = "division by zero";
+					return false;
+				}
+				value /= right;
+				break;
+			case kOpMod:
+				if(right == 0.)
+				{
+					expressionError = "division by zero";
+					return false;
+				}
+				value = fmod(value, right);
+				if(value < 0.)
+					value += fabs(right);
+				break;
+			case kOpPower:		value = pow(value, right); break;
+		}
+	}
+}
@@ -0,0 +1,53 @@
+/************
+ * Parameters and Expressions
+ *
+ * RS274NGC style: #n reads parameter n, #n=value sets it. Values of words
+ * can be parameters or expressions in square brackets, e.g. X[#1*2+0.5].
+ * Binary operators, lowest precedence first:
+ *   AND OR XOR / EQ NE GT GE LT LE / + - / * / MOD / **
+ * Functions: ABS ACOS ASIN ATAN[y]/[x] COS EXP FIX FUP LN ROUND SIN SQRT TAN
+ * (angles in degrees). True is 1, false is 0.
+ *
+ * #5061..#5065 are the X, Y, Z, A and B of the last G38.x probe, #5070 is 1
+ * if it triggered. They can only be read. A line reading parameters waits
+ * until the commands queued before it have been executed.
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#ifndef EXPRESSION_H
+#define EXPRESSION_H
+
+#include "Arduino.h"
+#include "configuration.h"
+#include "vectors.h"
+
+#define PARAMETER_PROBE_BASE 5061
+#define PARAMETER_PROBE_SUCCESS 5070
+
+// Read a value (number, parameter, [expression] or function) at p and advance p.
+// Returns false on errors, see expressionError.
+bool readValue(const char*& p, float& value);
+
+bool setParameter(int n, float value);
+void setProbeResult(const FloatPoint& p, bool success);
+
+extern const char* expressionError;
+
+#endif
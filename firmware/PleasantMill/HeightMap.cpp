@@ -0,0 +1,128 @@
+/************
+ * Height Map
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#include <EEPROM.h>
+#include "HeightMap.h"
+#include "Persistent.h"
+
+HeightMap heightMap;
+
+HeightMap::HeightMap()
+{
+	countX = 0;
+	countY = 0;
+	enabled = false;
+	queuedOffset = 0;
+}
+
+// Called at startup. The map stays off until M420 S1 (or the next G29).
+void HeightMap::load()
+{
+	enabled = false;
+	countX = EEPROM.read(EEPROM_ADR_MESH_HEADER+4*sizeof(float));
+	countY = EEPROM.read(EEPROM_ADR_MESH_HEADER+4*sizeof(float)+1);
+	if(!valid() || countX > MESH_MAX_POINTS_X || countY > MESH_MAX_POINTS_Y)
+	{
+		countX = 0;
+		countY = 0;
+		return;
+	}
+	originX = EEPROM_ReadFloat(EEPROM_ADR_MESH_HEADER);
+	originY = EEPROM_ReadFloat(EEPROM_ADR_MESH_HEADER+sizeof(float));
+	spacingX = EEPROM_ReadFloat(EEPROM_ADR_MESH_HEADER+2*sizeof(float));
+	spacingY = EEPROM_ReadFloat(EEPROM_ADR_MESH_HEADER+3*sizeof(float));
+	for(int k=0; k<countX*countY; k++)
+		z[k] = EEPROM_ReadFloat(EEPROM_ADR_MESH_BASE+k*EEPROM_SIZE_MESH_VALUE);
+}
+
+void HeightMap::save()
+{
+	EEPROM_WriteFloat(EEPROM_ADR_MESH_HEADER, originX);
+	EEPROM_WriteFloat(EEPROM_ADR_MESH_HEADER+sizeof(float), originY);
+	EEPROM_WriteFloat(EEPROM_ADR_MESH_HEADER+2*sizeof(float), spacingX);
+	EEPROM_WriteFloat(EEPROM_ADR_MESH_HEADER+3*sizeof(float), spacingY);
+	for(int k=0; k<countX*countY; k++)
+		EEPROM_WriteFloat(EEPROM_ADR_MESH_BASE+k*EEPROM_SIZE_MESH_VALUE, z[k]);
+	EEPROM.write(EEPROM_ADR_MESH_HEADER+4*sizeof(float), countX);
+	EEPROM.write(EEPROM_ADR_MESH_HEADER+4*sizeof(float)+1, countY);
+}
+
+// The old map is gone from RAM until finish() or load()
+bool HeightMap::setGrid(float x, float y, float width, float height, byte nx, byte ny)
+{
+	if(nx < 2 || ny < 2 || nx > MESH_MAX_POINTS_X || ny > MESH_MAX_POINTS_Y || width <= 0. || height <= 0.)
+		return false;
+	enabled = false;
+	originX = x;
+	originY = y;
+	spacingX = width/(nx-1);
+	spacingY = height/(ny-1);
+	countX = nx;
+	countY = ny;
+	for(int k=0; k<countX*countY; k++)
+		z[k] = 0.;
+	return true;
+}
+
+// All points are probed: relative to the first one, stored and active
+void HeightMap::finish()
+{
+	float first = z[0];
+	for(int k=0; k<countX*countY; k++)
+		z[k] -= first;
+	save();
+	enabled = true;
+}
+
+bool HeightMap::enable(bool on)
+{
+	if(on && !valid())
+		return false;
+	enabled = on;
+	return true;
+}
+
+float HeightMap::height(float x, float y)
+{
+	float fx = constrain((x-originX)/spacingX, 0., (float)(countX-1));
+	float fy = constrain((y-originY)/spacingY, 0., (float)(countY-1));
+	byte i = min((byte)fx, (byte)(countX-2));
+	byte j = min((byte)fy, (byte)(countY-2));
+	float tx = fx-i;
+	float ty = fy-j;
+	float z0 = point(i, j)*(1.-tx) + point(i+1, j)*tx;
+	float z1 = point(i, j+1)*(1.-tx) + point(i+1, j+1)*tx;
+	return z0*(1.-ty) + z1*ty;
+}
+
+long HeightMap::offsetSteps(long x, long y)
+{
+	if(!enabled)
+		return 0;
+	return round(height(x/(float)(X_STEPS_PER_MM), y/(float)(Y_STEPS_PER_MM))*(Z_STEPS_PER_MM));
+}
+
+int HeightMap::segments(float dx, float dy)
+{
+	float cells = max(fabs(dx)/spacingX, fabs(dy)/spacingY);
+	return max(1, (int)ceil(cells*MESH_SEGMENTS_PER_CELL));
+}
@@ -0,0 +1,82 @@
+/************
+ * Height Map
+ *
+ * A grid of Z heights probed by G29, e.g. over a warped PCB blank. While it's
+ * active (M420 S1), every move ends at its Z plus the height of the surface
+ * below its target (cartesian_dda::set_target()), bilinear between the grid
+ * points and held at the edge value outside the grid. MachineModel::qMove()
+ * cuts moves into MESH_SEGMENTS_PER_CELL pieces per grid cell, so Z follows
+ * the surface in between, too.
+ *
+ * The grid lies in machine coordinates (mm), the heights are relative to the
+ * first point probed. Touch off Z there and the job runs as it was written.
+ * The map is kept in the EEPROM.
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#ifndef HEIGHTMAP_H
+#define HEIGHTMAP_H
+
+#include "Arduino.h"
+#include "configuration.h"
+
+class HeightMap
+{
+private:
+	float originX;		// Machine coordinates of the first point, mm
+	float originY;
+	float spacingX;		// Between two points, mm
+	float spacingY;
+	byte countX;		// 0 = no map
+	byte countY;
+	float z[MESH_MAX_POINTS_X*MESH_MAX_POINTS_Y];	// mm, row by row
+	bool enabled;
+
+public:
+	HeightMap();
+
+	void load();
+	void save();
+
+	// G29: a new grid, its points are filled in one by one
+	bool setGrid(float x, float y, float width, float height, byte nx, byte ny);
+	void setPoint(byte i, byte j, float height) { z[j*countX+i] = height; }
+	void finish();
+
+	bool valid() { return countX >= 2 && countY >= 2; }
+	byte pointsX() { return countX; }
+	byte pointsY() { return countY; }
+	float point(byte i, byte j) { return z[j*countX+i]; }
+	float pointX(byte i) { return originX + i*spacingX; }
+	float pointY(byte j) { return originY + j*spacingY; }
+
+	bool enable(bool on);		// M420, false if there's no map
+	bool active() { return enabled; }
+
+	float height(float x, float y);		// mm at machine coordinates in mm
+	long offsetSteps(long x, long y);	// Z steps at a position in steps, 0 when not active
+	int segments(float dx, float dy);	// The pieces for a move of dx, dy mm
+
+	long queuedOffset;	// The Z offset in steps the last queued move ends with
+};
+
+extern HeightMap heightMap;
+
+#endif
@@ -0,0 +1,172 @@
+/************
+ * Host Serial Port
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#include "HostSerial.h"
+#include "MachineModel.h"
+
+HostSerial hostSerial;
+
+HostSerial::HostSerial()
+{
+	rxHead = 0;
+	rxTail = 0;
+	rxOverflow = false;
+	txHead = 0;
+	txTail = 0;
+	baud = HOST_BAUD;
+	pendingBaud = 0;
+	previousBaud = HOST_BAUD;
+	confirmDeadline = 0;
+}
+
+// 8N1, double speed mode (like Arduino's Serial, the baud rate errors are smaller)
+void HostSerial::begin(long newBaud)
+{
+	baud = newBaud;
+	pendingBaud = 0;
+	confirmDeadline = 0;
+	unsigned int ubrr = (F_CPU / 4 / baud - 1) / 2;
+	UCSR0A = (1<<U2X0);
+	UBRR0H = ubrr >> 8;
+	UBRR0L = ubrr;
+	UCSR0C = (1<<UCSZ01) | (1<<UCSZ00);
+	UCSR0B = (1<<RXEN0) | (1<<TXEN0) | (1<<RXCIE0);
+}
+
+// Can the UART hit this rate within 2.5%? (115200 at 16MHz is off by 2.1%)
+bool HostSerial::baudSupported(long rate)
+{
+	if(rate < 2400 || rate > F_CPU/8)
+		return false;
+	long ubrr = (F_CPU / 4 / rate - 1) / 2;
+	long actual = F_CPU / 8 / (ubrr + 1);
+	return labs(actual - rate) <= rate/40;
+}
+
+// Called from MachineModel::manage(): switch to the rate set by M906 once its ok is out,
+// go back if the host doesn't confirm in time. Returns true when it went back.
+bool HostSerial::manageBaud()
+{
+	if(pendingBaud)
+	{
+		long newBaud = pendingBaud;
+		long oldBaud = baud;
+		drain();
+		delayMicroseconds(20000000L/baud);	// The last two characters leave the shift register
+		begin(newBaud);
+		flush();
+		previousBaud = oldBaud;
+		confirmDeadline = millis() + BAUD_CONFIRM_TIMEOUT;
+		if(!confirmDeadline)
+			confirmDeadline = 1;
+		return false;
+	}
+	if(confirmDeadline && (long)(millis() - confirmDeadline) > 0)
+	{
+		begin(previousBaud);
+		flush();
+		return true;
+	}
+	return false;
+}
+
+char HostSerial::read()
+{
+	if(rxHead == rxTail)
+		return -1;
+	char c = rxBuffer[rxTail];
+	rxTail++;
+	return c;
+}
+
+// Has a character been lost since the last call?
+bool HostSerial::overflowed()
+{
+	bool o = rxOverflow;
+	rxOverflow = false;
+	return o;
+}
+
+// Nobody empties the buffer while the interrupts are off (e.g. in MachineModel::shutdown()),
+// so send by hand then
+inline void transmitPolled()
+{
+	if(!(SREG & (1<<SREG_I)) && (UCSR0A & (1<<UDRE0)))
+		hostSerial.transmitNext();
+}
+
+void HostSerial::write(char c)
+{
+	byte next = (txHead+1) & (HOST_TX_BUFFER_SIZE-1);
+	while(next == txTail)
+		transmitPolled();
+	txBuffer[txHead] = c;
+	txHead = next;
+	UCSR0B |= (1<<UDRIE0);
+}
+
+// Wait until everything has been sent
+void HostSerial::drain()
+{
+	while(txHead != txTail)
+		transmitPolled();
+}
+
+void HostSerial::print(const char* s)
+{
+	while(*s)
+		write(*s++);
+}
+
+ISR(USART0_UDRE_vect)
+{
+	hostSerial.transmitNext();
+}
+
+ISR(USART0_RX_vect)
+{
+	if(UCSR0A & ((1<<FE0) | (1<<UPE0)))
+	{
+		UDR0;				// Framing or parity error: read and drop it
+		return;
+	}
+	char c = UDR0;
+	switch(c)
+	{
+		case RT_STATUS:
+			sharedMachineModel.statusRequested = true;
+			break;
+		case RT_FEED_HOLD:
+			sharedMachineModel.feedHold = true;
+			break;
+		case RT_RESUME:
+			sharedMachineModel.feedHold = false;
+			break;
+		case RT_RESET:
+			// The queues are cleared in MachineModel::manage(), but the steps stop now (see the timer interrupt)
+			sharedMachineModel.resetState = kResetRequested;
+			break;
+		default:
+			hostSerial.received(c);
+			break;
+	}
+}
@@ -0,0 +1,123 @@
+/************
+ * Host Serial Port
+ *
+ * Driver for UART0, which talks to the host. Received characters are put
+ * into a ring buffer by the receive interrupt, so no character gets lost
+ * while the G-code processor waits for room in the motion queue.
+ * Characters to send go into another ring buffer, which is emptied by the
+ * data register empty interrupt. Writing only waits if that buffer is full.
+ * The host may keep as many characters in flight as fit into the buffer
+ * (character counting, see rxBufferSize() and hostcom.h).
+ * A few single characters are real-time commands. They're taken by the
+ * receive interrupt and never get into the buffer (so they can't be used
+ * in comments or strings either).
+ * This replaces Arduino's Serial for the host port: don't use both.
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#ifndef HOSTSERIAL_H
+#define HOSTSERIAL_H
+
+#include "Arduino.h"
+#include "configuration.h"
+
+// The indices are bytes, so the buffer has to be 256 characters (they wrap around by themselves)
+#define HOST_RX_BUFFER_SIZE 256
+
+// Must be a power of 2
+#define HOST_TX_BUFFER_SIZE 128
+
+// Real-time commands
+#define RT_STATUS		'?'		// Report state and position (as an informational line)
+#define RT_FEED_HOLD	'!'		// Slow down and stop, the queues are kept
+#define RT_RESUME		'~'		// Continue after a feed hold
+#define RT_RESET		0x18	// Ctrl-X: Stop, throw away all queued moves and commands
+
+class HostSerial
+{
+private:
+	char rxBuffer[HOST_RX_BUFFER_SIZE];
+	volatile byte rxHead;			// Written by the interrupt
+	volatile byte rxTail;
+	volatile bool rxOverflow;
+	
+	char txBuffer[HOST_TX_BUFFER_SIZE];
+	volatile byte txHead;
+	volatile byte txTail;			// Written by the interrupt
+	
+	long baud;
+	long pendingBaud;				// M906: switch to it once its ok has been sent
+	long previousBaud;				// Back to it unless the host confirms in time
+	unsigned long confirmDeadline;	// 0 = nothing to confirm
+
+public:
+	HostSerial();
+
+	void begin(long baud);
+	long baudRate() { return baud; }
+	
+	// Baud rate change (M906, see hostcom.h)
+	static bool baudSupported(long baud);
+	void changeBaud(long newBaud) { pendingBaud = newBaud; }
+	bool awaitingConfirmation() { return confirmDeadline != 0; }
+	void confirmBaud() { confirmDeadline = 0; }
+	bool manageBaud();
+
+	// Called from the receive interrupt
+	void received(char c)
+	{
+		byte next = rxHead+1;
+		if(next == rxTail)
+			rxOverflow = true;		// Drop it, the host didn't count right
+		else
+		{
+			rxBuffer[rxHead] = c;
+			rxHead = next;
+		}
+	}
+
+	byte available() { return (byte)(rxHead - rxTail); }
+	char read();
+	void flush() { rxTail = rxHead; }
+	bool overflowed();
+
+	// The number of characters the host may send without waiting for an ok
+	int rxBufferSize() { return HOST_RX_BUFFER_SIZE-1; }
+
+	void write(char c);
+	void print(const char* s);
+	void drain();
+	
+	// Called from the data register empty interrupt
+	void transmitNext()
+	{
+		if(txHead == txTail)
+		{
+			UCSR0B &= ~(1<<UDRIE0);		// Nothing more to send
+			return;
+		}
+		UDR0 = txBuffer[txTail];
+		txTail = (txTail+1) & (HOST_TX_BUFFER_SIZE-1);
+	}
+};
+
+extern HostSerial hostSerial;
+
+#endif
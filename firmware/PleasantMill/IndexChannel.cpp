@@ -0,0 +1,186 @@
+/************
+ * Index Channel
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#include "IndexChannel.h"
+
+IndexChannel::IndexChannel()
+{
+	head = 0;
+	tail = 0;
+	live = false;
+	timestep = DEFAULT_TICK;
+
+	pinMode(A_STEP_PIN, OUTPUT);
+	pinMode(A_DIR_PIN, OUTPUT);
+	pinMode(B_STEP_PIN, OUTPUT);
+	pinMode(B_DIR_PIN, OUTPUT);
+#ifdef A_ENABLE_PIN
+	pinMode(A_ENABLE_PIN, OUTPUT);
+#endif
+#ifdef B_ENABLE_PIN
+	pinMode(B_ENABLE_PIN, OUTPUT);
+#endif
+}
+
+// Not called from the interrupt. The caller has to make sure there's room (qFull())
+
+void IndexChannel::qMove(long fromA, long fromB, long toA, long toB, long interval)
+{
+	IndexMove& m = moves[head];
+	m.fromA = fromA;
+	m.fromB = fromB;
+	m.toA = toA;
+	m.toB = toB;
+	m.interval = interval;
+	head = (head+1)%INDEX_BUFFER_SIZE;
+}
+
+// Take the next move from the queue
+
+void IndexChannel::start()
+{
+	IndexMove& m = moves[tail];
+	current_a = m.fromA;
+	current_b = m.fromB;
+	target_a = m.toA;
+	target_b = m.toB;
+	timestep = m.interval;
+	tail = (tail+1)%INDEX_BUFFER_SIZE;
+
+	delta_a = abs(target_a - current_a);
+	delta_b = abs(target_b - current_b);
+	total_steps = max(delta_a, delta_b);
+	if(total_steps == 0)
+	{
+		timestep = DEFAULT_TICK;
+		return;
+	}
+
+	a_direction = (target_a >= current_a);
+	b_direction = (target_b >= current_b);
+	counter_a = -total_steps/2;
+	counter_b = counter_a;
+
+	// Only touch the direction pins of axes which move: the other axis may still
+	// be in use by the cartesian_dda queue
+	byte d;
+	if(delta_a)
+	{
+		d = 1;
+#if INVERT_A_DIR == 1
+		if(a_direction)
+			d = 0;
+#else
+		if(!a_direction)
+			d = 0;
+#endif
+		digitalWrite(A_DIR_PIN, d);
+#ifdef A_ENABLE_PIN
+		digitalWrite(A_ENABLE_PIN, ENABLE_ON);
+#endif
+	}
+	if(delta_b)
+	{
+		d = 1;
+#if INVERT_B_DIR == 1
+		if(b_direction)
+			d = 0;
+#else
+		if(!b_direction)
+			d = 0;
+#endif
+		digitalWrite(B_DIR_PIN, d);
+#ifdef B_ENABLE_PIN
+		digitalWrite(B_ENABLE_PIN, ENABLE_ON);
+#endif
+	}
+
+	live = true;
+}
+
+void IndexChannel::finish()
+{
+	live = false;
+	timestep = DEFAULT_TICK;
+#if DISABLE_A
+	if(delta_a)
+		digitalWrite(A_ENABLE_PIN, !ENABLE_ON);
+#endif
+#if DISABLE_B
+	if(delta_b)
+		digitalWrite(B_ENABLE_PIN, !ENABLE_ON);
+#endif
+}
+
+// This function is called by the timer interrupt whenever the channel is due.
+// Each call makes one step on the dominant axis.
+
+void IndexChannel::step()
+{
+	if(!live)
+	{
+		// The first step follows one interval after the direction pins have been set
+		if(head != tail)
+			start();
+		return;
+	}
+
+	if(current_a != target_a)
+	{
+		counter_a += delta_a;
+		if(counter_a > 0)
+		{
+			digitalWrite(A_STEP_PIN, HIGH);
+			digitalWrite(A_STEP_PIN, LOW);
+			counter_a -= total_steps;
+			if(a_direction)
+				current_a++;
+			else
+				current_a--;
+		}
+	}
+
+	if(current_b != target_b)
+	{
+		counter_b += delta_b;
+		if(counter_b > 0)
+		{
+			digitalWrite(B_STEP_PIN, HIGH);
+			digitalWrite(B_STEP_PIN, LOW);
+			counter_b -= total_steps;
+			if(b_direction)
+				current_b++;
+			else
+				current_b--;
+		}
+	}
+
+	if(current_a == target_a && current_b == target_b)
+		finish();
+}
+
+void IndexChannel::shutdown()
+{
+	tail = head;
+	if(live)
+		finish();
+}
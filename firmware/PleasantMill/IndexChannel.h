@@ -0,0 +1,94 @@
+/************
+ * Index Channel
+ *
+ * A second, independent motion channel for the rotary axes A and B.
+ * It has its own small queue and step timing, and is driven from the
+ * same timer interrupt as the cartesian_dda queue. While an index move
+ * runs, the XYZ axes can continue with their own moves.
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#ifndef INDEXCHANNEL_H
+#define INDEXCHANNEL_H
+
+#include "Arduino.h"
+#include "configuration.h"
+#include "pins.h"
+
+class IndexChannel
+{
+private:
+	struct IndexMove
+	{
+		long fromA;		// Absolute steps
+		long fromB;
+		long toA;
+		long toB;
+		long interval;	// Microseconds between steps of the dominant axis
+	};
+
+	IndexMove moves[INDEX_BUFFER_SIZE];
+	volatile byte head;		// Next free slot
+	volatile byte tail;		// Next move to start
+
+	long current_a;			// The move being executed, in steps
+	long current_b;
+	long target_a;
+	long target_b;
+	long delta_a;
+	long delta_b;
+	long counter_a;			// DDA error-accumulation variables
+	long counter_b;
+	long total_steps;
+	bool a_direction;
+	bool b_direction;
+	long timestep;
+	volatile bool live;
+
+	void start();
+	void finish();
+
+public:
+	IndexChannel();
+
+	void qMove(long fromA, long fromB, long toA, long toB, long interval);
+	bool qFull();
+
+	// Moving or moves waiting?
+	bool busy();
+
+	// Called by the timer interrupt when the channel is due
+	void step();
+	long stepInterval() { return timestep; }
+
+	void shutdown();
+};
+
+inline bool IndexChannel::qFull()
+{
+	return (byte)((head+1)%INDEX_BUFFER_SIZE) == tail;
+}
+
+inline bool IndexChannel::busy()
+{
+	return live || head != tail;
+}
+
+#endif
@@ -671,7 +671,7 @@ void LcdUi::jogXY(byte keyState)
 		if(keyState!=kKeyStateNone)
 		{
 			p.f=FAST_XY_FEEDRATE;
-			sharedMachineModel.qMove(p);
+			sharedMachineModel.qMove(p, true);
 		}
 	}
   }
@@ -707,7 +707,7 @@ void LcdUi::jogZ(byte keyState)
 		if(keyState!=kKeyStateNone)
 		{
 			p.f=FAST_Z_FEEDRATE;
-			sharedMachineModel.qMove(p);
+			sharedMachineModel.qMove(p, true);
 		}
 	}
   }
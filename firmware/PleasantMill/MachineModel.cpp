@@ -22,9 +22,14 @@
  
 #include "MachineModel.h"
 #include "cartesian_dda.h"
+#include "IndexChannel.h"
+#include "interruptHandling.h"
 #include "LCDUI.h"
 #include "hostcom.h"
 #include "Persistent.h"
+#include "BinaryProtocol.h"
+#include "Spindle.h"
+#include "HeightMap.h"
 
 extern hostcom talkToHost;
 
@@ -33,8 +38,15 @@ static cartesian_dda cdda1;
 static cartesian_dda cdda2;
 static cartesian_dda cdda3;
 
+static IndexChannel indexChannel;
+
 static LcdUi  lcdUi;
 
+static void probeInterrupt()
+{
+  sharedMachineModel.probeLatch();
+}
+
 MachineModel::MachineModel()
 {
   cdda[0] = &cdda0;
@@ -43,6 +55,9 @@ MachineModel::MachineModel()
   cdda[3] = &cdda3;
   head = 0;
   tail = 0;
+  tick = DEFAULT_TICK;
+  mainDue = 0;
+  indexDue = 0;
   led = false;
 	
   absolutePositionValid=false; // Until the first hardware homing
@@ -51,9 +66,22 @@ MachineModel::MachineModel()
   receiving = false;
   
   clearanceIncrement=2.5; // TODO: Systemparameter, should be read from EEPROM
+  currentTool = 0;
+  activeWCS = -1;
+  cylinderRadius=0.;
+  cylinderY=0.;
+  gearMaster = kGearNone;
+  gearSlave = kGearNone;
+  currentLine = -1;
+  telemetryInterval = 0;
+  outputs = 0;
+  pendingOutputsOn = 0;
+  pendingOutputsOff = 0;
   
+  using_mm = true;
   setUnits(true);		// Default units are mm
   setAbsMode(true);		// Default is absolute mode
+  setInverseTimeMode(false); // Default is units per minute feed mode
   setRetractMode(true); // Default is Retract to old Z mode
   setRetractHeight(0.);
   stickyQ = 0.;
@@ -63,7 +91,27 @@ MachineModel::MachineModel()
 void MachineModel::startup()
 {
   lcdUi.startup();
+  const byte outputPins[] = DIGITAL_OUTPUT_PINS;
+  for(byte i = 0; i < DIGITAL_OUTPUT_COUNT; i++)
+  {
+    pinMode(outputPins[i], OUTPUT);
+    digitalWrite(outputPins[i], 0);
+  }
+  spindle.startup();
+  pinMode(PROBE_PIN, INPUT);
+#if OPTO_PULLUPS_INTERNAL == 1
+  digitalWrite(PROBE_PIN, HIGH);
+#endif
+  heightMap.load();
+  probing = false;
+  probeLatchPending = false;
+  stepping = false;
+  attachInterrupt(PROBE_INTERRUPT, probeInterrupt, CHANGE);
   emergencyStop = false;
+  feedHold = false;
+  held = false;
+  statusRequested = false;
+  resetState = kResetNone;
 }
 
 // This does a hard stop.  It disables interrupts, turns off all the motors 
@@ -105,6 +153,10 @@ void MachineModel::shutdown()
   // LED off
   digitalWrite(DEBUG_PIN, 0);
   
+  // Valves, air and whatever else hangs on the outputs
+  setOutputs(0, outputs);
+  spindle.cancel();
+  
   // Till the end of time...
   for(;;); 
 }
@@ -118,6 +170,32 @@ void MachineModel::manage(bool withGUI)
 //#endif
 	if(withGUI)  
   		lcdUi.handleUI();
+  	
+  	// Real-time commands from the host. This is called while waiting for the queue, too.
+  	if(resetState == kResetRequested)
+  	{
+  		cancelAndClearQueue();
+  		pendingOutputsOn = 0;
+  		pendingOutputsOff = 0;
+  		spindle.cancel();
+  		probing = false;
+  		heightMap.queuedOffset = heightMap.offsetSteps(absolutePosition.x, absolutePosition.y);	// Close enough to where Z was stopped
+  		resetState = kResetDone;
+  		feedHold = false;
+  		held = false;
+  	}
+  	if(statusRequested)
+  	{
+  		statusRequested = false;
+  		talkToHost.sendStatus();
+  	}
+  	if(hostSerial.manageBaud())
+  		talkToHost.informational("Error: new baud rate not confirmed (M906), back to the old one");
+  	if(telemetryInterval && millis()-lastTelemetry >= telemetryInterval)
+  	{
+  		lastTelemetry = millis();
+  		sendTelemetry();
+  	}
 }
 
 void MachineModel::blink()
@@ -136,6 +214,7 @@ void MachineModel::cancelAndClearQueue()
 	tail = head;	// clear buffer
 	for(int i=0;i<BUFFER_SIZE;i++)
 		cdda[i]->shutdown();
+	indexChannel.shutdown();
 	sei();
 }
 
@@ -155,7 +234,7 @@ bool MachineModel::qFull()
 void MachineModel::waitFor_qEmpty()
 {
 // while waiting maintain the temperatures
-  while(!qEmpty()) {
+  while(!qEmpty() || indexChannel.busy()) {
     manage(true);
   }
 }
@@ -168,17 +247,196 @@ void MachineModel::waitFor_qNotFull()
   }
 }
 
-void MachineModel::qMove(const FloatPoint& p)
+void MachineModel::qMove(const FloatPoint& p, bool rapid)
+{
+  // A and B can't be moved while they're busy on the index channel
+  FloatPoint from = toMachine(localPosition);
+  FloatPoint to = toMachine(p);
+  if(from.a != to.a || from.b != to.b)
+    waitFor_indexIdle();
+  
+  // With a height map, Z has to follow the surface between the ends of the move, too
+  if(heightMap.active())
+  {
+    float mm = using_mm ? 1. : INCHES_TO_MM;
+    int segments = heightMap.segments((to.x-from.x)*mm, (to.y-from.y)*mm);
+    FloatPoint start = localPosition;
+    for(int i = 1; i < segments && resetState == kResetNone; i++)
+    {
+      float t = (float)i/segments;
+      FloatPoint q = p;
+      q.x = start.x + (p.x-start.x)*t;
+      q.y = start.y + (p.y-start.y)*t;
+      q.z = start.z + (p.z-start.z)*t;
+      q.a = start.a + (p.a-start.a)*t;
+      q.b = start.b + (p.b-start.b)*t;
+      qSegment(q, rapid);
+    }
+  }
+  qSegment(p, rapid);
+}
+
+// One block of qMove()
+void MachineModel::qSegment(const FloatPoint& p, bool rapid)
+{
+  waitFor_qNotFull();
+  if(resetState != kResetNone)	// Whatever was being processed is cancelled
+    return;
+  byte h = head; 
+  h++;
+  if(h >= BUFFER_SIZE)
+    h = 0;
+  cdda[h]->set_target(p, rapid);
+  cdda[h]->set_outputs(pendingOutputsOn, pendingOutputsOff);
+  pendingOutputsOn = 0;
+  pendingOutputsOff = 0;
+  head = h;
+}
+
+// Move towards p until the probe touches (toContact) or loses contact, false if it doesn't.
+// The position where it happened is in probeSteps (see probePosition()), the axes stop a
+// little later. Check the probe before, if it's already there, the move wouldn't stop.
+bool MachineModel::probeMove(const FloatPoint& p, bool toContact)
+{
+  waitFor_qEmpty();
+  probeStopOn = toContact;
+  probeTriggered = false;
+  probing = true;
+  qSegment(p);
+  waitFor_qEmpty();
+  probing = false;
+  if(resetState != kResetNone)
+    return false;
+  FloatPoint live = livePosition();
+  localPosition.x = live.x;
+  localPosition.y = live.y;
+  localPosition.z = live.z;
+  return probeTriggered;
+}
+
+// Called by the probe interrupt on every change of the pin. The step interrupt lets other
+// interrupts in, so the step counters may be half updated while it runs. Then it takes
+// the position itself as soon as the step is done.
+void MachineModel::probeLatch()
+{
+  if(probing && !probeTriggered && !probeLatchPending && probeContact() == probeStopOn)
+  {
+    if(stepping)
+      probeLatchPending = true;
+    else
+      latchProbe();
+  }
+}
+
+void MachineModel::latchProbe()
+{
+  probeSteps = cdda[tail]->stepPosition();
+  probeTriggered = true;
+  probeLatchPending = false;
+}
+
+// The latched position in program coordinates
+FloatPoint MachineModel::probePosition()
+{
+  LongPoint steps = probeSteps;
+  steps.z -= heightMap.offsetSteps(steps.x, steps.y);
+  FloatPoint p = from_steps(units, steps) - localZeroOffset;
+  p.f = localPosition.f;
+  return p;
+}
+
+// A dwell in the queue: the moves before it finish, the ones after it wait
+void MachineModel::qDwell(unsigned long milliseconds)
+{
+  waitFor_qNotFull();
+  if(resetState != kResetNone)
+    return;
+  byte h = head; 
+  h++;
+  if(h >= BUFFER_SIZE)
+    h = 0;
+  cdda[h]->set_dwell(milliseconds);
+  cdda[h]->set_outputs(pendingOutputsOn, pendingOutputsOff);
+  pendingOutputsOn = 0;
+  pendingOutputsOff = 0;
+  head = h;
+}
+
+// Queue an action which is taken when all moves before it are done
+void MachineModel::qSync(byte action, byte value)
 {
   waitFor_qNotFull();
+  if(resetState != kResetNone)
+    return;
   byte h = head; 
   h++;
   if(h >= BUFFER_SIZE)
     h = 0;
-  cdda[h]->set_target(p);
+  cdda[h]->set_sync(action, value);
   head = h;
 }
 
+// M62/M63: The output switches when the next move (or dwell) starts, so the
+// moves don't have to stop for it
+void MachineModel::qOutput(byte output, bool on)
+{
+  byte bit = 1<<output;
+  if(on)
+  {
+    pendingOutputsOn |= bit;
+    pendingOutputsOff &= ~bit;
+  }
+  else
+  {
+    pendingOutputsOff |= bit;
+    pendingOutputsOn &= ~bit;
+  }
+}
+
+// Called from the timer interrupt when a block with output changes starts
+void MachineModel::setOutputs(byte on, byte off)
+{
+  const byte outputPins[] = DIGITAL_OUTPUT_PINS;
+  for(byte i = 0; i < DIGITAL_OUTPUT_COUNT; i++)
+  {
+    byte bit = 1<<i;
+    if(on & bit)
+      digitalWrite(outputPins[i], 1);
+    else if(off & bit)
+      digitalWrite(outputPins[i], 0);
+  }
+  outputs = (outputs | on) & ~off;
+}
+
+// Called from the timer interrupt when a sync block is reached
+void MachineModel::syncAction(byte action, byte value)
+{
+  switch(action)
+  {
+    case kSyncEnableSteppers:
+#if ENABLE_LINES == HAS_ENABLE_LINES
+      digitalWrite(X_ENABLE_PIN, ENABLE_ON);
+      digitalWrite(Y_ENABLE_PIN, ENABLE_ON);
+      digitalWrite(Z_ENABLE_PIN, ENABLE_ON);
+#endif
+      break;
+      
+    case kSyncDisableSteppers:
+#if ENABLE_LINES == HAS_ENABLE_LINES
+      digitalWrite(X_ENABLE_PIN, !ENABLE_ON);
+      digitalWrite(Y_ENABLE_PIN, !ENABLE_ON);
+      digitalWrite(Z_ENABLE_PIN, !ENABLE_ON);
+#endif
+      break;
+      
+    case kSyncSpindleOff:
+    case kSyncSpindleCW:
+    case kSyncSpindleCCW:
+      spindle.apply(action-kSyncSpindleOff, value);
+      break;
+  }
+}
+
 void MachineModel::dQMove()
 {
   if(!qEmpty())
@@ -189,9 +447,135 @@ void MachineModel::dQMove()
   }
 }
 
-// Switch between mm and inches
+// The number of blocks in the queue, including the running one
+byte MachineModel::qCount()
+{
+  byte t = tail;
+  byte h = head;
+  return (h+BUFFER_SIZE-t)%BUFFER_SIZE + (cdda[t]->active() ? 1 : 0);
+}
+
+// M905: 0 = off
+void MachineModel::setTelemetryRate(int hz)
+{
+  telemetryInterval = (hz > 0) ? 1000/hz : 0;
+  lastTelemetry = millis();
+}
+
+// One telemetry frame (see BinaryProtocol.h)
+void MachineModel::sendTelemetry()
+{
+  Telemetry t;
+  LongPoint steps;
+  cli();
+  byte running = tail;
+  bool moving = cdda[running]->active();
+  if(moving)
+    steps = cdda[running]->stepPosition();
+  sei();
+  if(!moving)	// Then the machine is where the last block has left it
+  {
+    steps = to_steps(units, toMachine(localPosition)+localZeroOffset);
+    steps.z += heightMap.queuedOffset;
+  }
+  t.steps[0] = steps.x;
+  t.steps[1] = steps.y;
+  t.steps[2] = steps.z;
+  t.steps[3] = steps.a;
+  t.steps[4] = steps.b;
+  t.line = moving ? cdda[running]->lineNr() : -1;
+  t.feed = cdda[running]->feedrate();
+  t.queued = qCount();
+  t.received = hostSerial.available();
+  t.endstops = endstop_hits;
+  t.state = 0;
+  if(feedHold)
+    t.state |= kTelemetryHold;
+  if(!qEmpty())
+    t.state |= kTelemetryRunning;
+  if(indexChannel.busy())
+    t.state |= kTelemetryIndexing;
+  binaryProtocol.sendFrame(kFrameTelemetry, (byte*)&t, sizeof(t));
+}
+
+// Is there a block in the queue (running or waiting) which turns A or B?
+bool MachineModel::rotaryQueued()
+{
+  byte t = tail;
+  if(cdda[t]->active() && cdda[t]->movesRotary())
+    return true;
+  while(t != head)
+  {
+    t = (t+1)%BUFFER_SIZE;
+    if(cdda[t]->movesRotary())
+      return true;
+  }
+  return false;
+}
+
+// The index channel moves A and B independently from the cartesian_dda queue.
+// p.f is the feedrate in degrees (or units) per minute.
+void MachineModel::qIndexMove(const FloatPoint& p)
+{
+  // Blocks which are already queued for A or B have to finish first
+  while(rotaryQueued())
+    manage(true);
+  while(indexChannel.qFull())
+    manage(true);
+  if(resetState != kResetNone)
+    return;
+  
+  LongPoint from = to_steps(units, localPosition+localZeroOffset);
+  LongPoint to = to_steps(units, p+localZeroOffset);
+  long total = max(abs(to.a-from.a), abs(to.b-from.b));
+  if(total>0 && p.f>0.)
+  {
+    float da = p.a-localPosition.a;
+    float db = p.b-localPosition.b;
+    long interval = round((sqrt(da*da+db*db)*60000000.0) / (p.f*(float)total));
+    indexChannel.qMove(from.a, from.b, to.a, to.b, interval);
+  }
+  localPosition.a = p.a;
+  localPosition.b = p.b;
+}
+
+bool MachineModel::indexBusy()
+{
+  return indexChannel.busy();
+}
+
+void MachineModel::waitFor_indexIdle()
+{
+  while(indexChannel.busy()) {
+    manage(true);
+  }
+}
+
+// Switch between mm and inches. Queued moves keep the units they were planned with,
+// the positions are converted so the next move continues where the last one ends.
 void MachineModel::setUnits(bool um)
 {
+	if(um != using_mm)
+	{
+		float factor = um ? 25.4 : 1./25.4;
+		localPosition.x *= factor;
+		localPosition.y *= factor;
+		localPosition.z *= factor;
+		localPosition.f *= factor;
+		localZeroOffset.x *= factor;
+		localZeroOffset.y *= factor;
+		localZeroOffset.z *= factor;
+#if !A_AXIS_ROTARY
+		localPosition.a *= factor;
+		localZeroOffset.a *= factor;
+#endif
+#if !B_AXIS_ROTARY
+		localPosition.b *= factor;
+		localZeroOffset.b *= factor;
+#endif
+		cylinderRadius *= factor;
+		cylinderY *= factor;
+	}
 	using_mm = um;
     if(using_mm)
     {
@@ -210,14 +594,76 @@ void MachineModel::setUnits(bool um)
       units.b = B_STEPS_PER_INCH;
       units.f = 1.0;  
     }
+#if A_AXIS_ROTARY
+    units.a = A_STEPS_PER_DEGREE;	// Rotary axes are always in degrees
+#endif
+#if B_AXIS_ROTARY
+    units.b = B_STEPS_PER_DEGREE;
+#endif
+}
+
+// The length of a move as far as the feedrate is concerned. The feedrate refers to
+// the distance in (X, Y, Z) space; the rotary axes only count if no linear axis moves.
+float MachineModel::feedDistance(const FloatPoint& delta)
+{
+	float d = delta.x*delta.x + delta.y*delta.y + delta.z*delta.z;
+	if(d < SMALL_DISTANCE2)
+		d = delta.a*delta.a + delta.b*delta.b;
+	return sqrt(d);
 }
 
+// Both motion channels share the timer. It's always set to the interval
+// of the channel which is due next.
 void MachineModel::handleInterrupt()
 {
-  if(cdda[tail]->active())
+  // Feed hold: the running move eases out first, then everything stands still
+  if(held)
+  {
+    if(feedHold)
+      return;
+    held = false;
+    cdda[tail]->resume();
+  }
+  else if(feedHold && cdda[tail]->slowedDown())
+  {
+    held = true;
+    return;
+  }
+  
+  mainDue -= tick;
+  if(mainDue <= 0)
+  {
+    stepping = true;
+    if(cdda[tail]->active())
 	  cdda[tail]->dda_step();
-  else
+    else
 	  dQMove();
+    stepping = false;
+    if(probeLatchPending)
+      latchProbe();
+    mainDue = cdda[tail]->stepInterval();
+  }
+  
+  long next = mainDue;
+  if(indexChannel.busy())
+  {
+    indexDue -= tick;
+    if(indexDue <= 0)
+    {
+      indexChannel.step();
+      indexDue = indexChannel.stepInterval();
+    }
+    if(indexDue < next)
+      next = indexDue;
+  }
+  else
+    indexDue = 0;
+  
+  if(next != tick)
+  {
+    tick = next;
+    setTimer(tick);
+  }
 }
 
 //
@@ -325,7 +771,17 @@ bool MachineModel::checkEndstops(byte flag, bool endstopHit, long current, bool
 
 FloatPoint MachineModel::livePosition()
 {
-	FloatPoint absolute = from_steps(units, absolutePosition);
+	// The move being executed may have been planned with other units or another zero offset
+	LongPoint steps = absolutePosition;
+	if(!qEmpty())
+	{
+		steps.z -= heightMap.offsetSteps(steps.x, steps.y);
+		FloatPoint live = cdda[tail]->toLocal(steps);
+		live.f = localPosition.f;
+		return live;
+	}
+	steps.z -= heightMap.queuedOffset;	// The height map's part isn't the program's
+	FloatPoint absolute = from_steps(units, steps);
 	absolute.f = localPosition.f;
 	return absolute-localZeroOffset;
 }
@@ -337,7 +793,7 @@ void MachineModel::specialMoveX(const float& x, const float& feed)
   FloatPoint sp = localPosition;
   sp.x = x;
   sp.f = feed;
-  qMove(sp);
+  qMove(sp, true);
 }
 
 void MachineModel::specialMoveY(const float& y, const float& feed)
@@ -345,7 +801,7 @@ void MachineModel::specialMoveY(const float& y, const float& feed)
   FloatPoint sp = localPosition;
   sp.y = y;
   sp.f = feed;
-  qMove(sp);
+  qMove(sp, true);
 }
 
 void MachineModel::specialMoveZ(const float& z, const float& feed)
@@ -353,7 +809,7 @@ void MachineModel::specialMoveZ(const float& z, const float& feed)
   FloatPoint sp = localPosition;
   sp.z = z; 
   sp.f = feed;
-  qMove(sp);
+  qMove(sp, true);
 }
 
 void MachineModel::zeroX()
@@ -370,6 +826,7 @@ void MachineModel::zeroX()
 	localPosition.x = 0.f;
 	localZeroOffset.x = 0.f;
 	absolutePosition.x = 0;
+	activeWCS = -1;
 
 	if(!isEndstopHit(X_LOW_HIT))
 	{
@@ -392,6 +849,7 @@ void MachineModel::zeroY()
   localPosition.y = 0.f;
   localZeroOffset.y = 0.f;
   absolutePosition.y = 0;
+  activeWCS = -1;
   
   if(!isEndstopHit(Y_LOW_HIT))
   {
@@ -416,6 +874,8 @@ void MachineModel::zeroZ()
   localPosition.z = (float)MACHINE_MAX_Z_MM;
   localZeroOffset.z = 0.f;
   absolutePosition.z = MACHINE_MAX_Z_STEPS;
+  activeWCS = -1;
+  heightMap.queuedOffset = 0;
  
   if(!isEndstopHit(Z_HIGH_HIT))
   {
@@ -442,6 +902,25 @@ void MachineModel::manualToolChange(int toolNumber)
 	else
 		strcpy(desc, "Unspecified Tool");
 	lcdUi.manualToolChange(desc);
+	currentTool = (toolNumber>0 && toolNumber<=TOOL_COUNT) ? toolNumber : 0;
+}
+
+// Tool diameters are stored in mm
+float MachineModel::toolDiameter(int toolNumber)
+{
+	if(toolNumber>0 && toolNumber<=TOOL_COUNT)
+		return EEPROM_ReadFloat(EEPROM_ADR_TOOL_DIAMETER_BASE+(toolNumber-1)*EEPROM_SIZE_TOOL_DIAMETER_VALUE);
+	return 0.;
+}
+
+bool MachineModel::setToolDiameter(int toolNumber, float diameter)
+{
+	if(toolNumber>0 && toolNumber<=TOOL_COUNT && diameter>=0.)
+	{
+		EEPROM_WriteFloat(EEPROM_ADR_TOOL_DIAMETER_BASE+(toolNumber-1)*EEPROM_SIZE_TOOL_DIAMETER_VALUE, diameter);
+		return true;
+	}
+	return false;
 }
 
 
@@ -450,6 +929,86 @@ void MachineModel::setLocalZero(FloatPoint zeroPoint)
 	localZeroOffset = localZeroOffset + localPosition - zeroPoint;
 	localZeroOffset.f = 0.;
 	localPosition = zeroPoint;
+	activeWCS = -1;		// The offset isn't the stored one anymore
+}
+
+// G7.1: While active, the Y coordinate is the distance on the surface of a cylinder
+// of the given radius around the A axis. The machine's Y axis stays where it is and
+// A turns instead. localPosition.y holds the unwrapped position in this mode.
+void MachineModel::setCylindricalInterpolation(float radius)
+{
+	if(cylinderRadius>0.)
+	{
+		localPosition.a = localPosition.y*180./(M_PI*cylinderRadius);
+		localPosition.y = cylinderY;
+	}
+	cylinderRadius = radius;
+	if(cylinderRadius>0.)
+	{
+		cylinderY = localPosition.y;
+		localPosition.y = localPosition.a*M_PI*cylinderRadius/180.;
+	}
+}
+
+// Convert a point in program coordinates into the coordinates the axes really move to
+FloatPoint MachineModel::toMachine(const FloatPoint& p)
+{
+	FloatPoint m = p;
+	if(cylinderRadius>0.)
+	{
+		m.a = p.y*180./(M_PI*cylinderRadius);
+		m.y = cylinderY;
+	}
+	return m;
+}
+
+// M915: The slave (A or B) turns slaveAmount while the master (X, Y or Z) moves masterAmount.
+// The ratio is kept as a fraction of steps, so the slave never drifts. It can't be more than
+// one slave step per master step.
+bool MachineModel::engageGear(byte slave, float slaveAmount, byte master, float masterAmount)
+{
+	float su = (slave == kGearA) ? units.a : units.b;
+	float mu = (master == kGearX) ? units.x : ((master == kGearY) ? units.y : units.z);
+	long num = round(slaveAmount*su);
+	long den = round(masterAmount*mu);
+	if(num == 0 || den == 0 || abs(num) > abs(den))	// At most one slave step per master step, they aren't spaced out
+		return false;
+	if(den < 0)
+	{
+		num = -num;
+		den = -den;
+	}
+	
+	// Reduce the fraction
+	long a = abs(num);
+	long b = den;
+	while(b != 0)
+	{
+		long t = a%b;
+		a = b;
+		b = t;
+	}
+	
+	// The slave must not be busy on the index channel
+	waitFor_indexIdle();
+	
+	gearNum = num/a;
+	gearDen = den/a;
+	gearMaster = master;
+	gearSlave = slave;
+	gearRemainder = 0;
+	return true;
+}
+
+// Called when a move is queued: the number of slave steps while the master moves
+// masterDelta steps. startAccumulator receives the accumulator the move starts with.
+long MachineModel::gearSlaveSteps(long masterDelta, long& startAccumulator)
+{
+	startAccumulator = gearRemainder;
+	long total = gearRemainder + masterDelta*gearNum;
+	long slaveSteps = total/gearDen;
+	gearRemainder = total - slaveSteps*gearDen;
+	return slaveSteps;
 }
 
 bool MachineModel::switchToWCS(int number)
@@ -460,7 +1019,39 @@ bool MachineModel::switchToWCS(int number)
 		FloatPoint currentOffset = localPosition+localZeroOffset;
 		localZeroOffset = EEPROM_ReadFloatPoint(EEPROM_ADR_WCS_BASE+number*EEPROM_SIZE_WCS_VALUE);
 		localPosition = currentOffset-localZeroOffset;
+		activeWCS = number;
 		success = true;
 	}
 	return success;
 }
+
+// Probing cycles (M930..M933): p (program coordinates) becomes the zero of the active
+// WCS on the given axes, the other axes keep their offsets. Stored like the LCD's "Set WCS".
+bool MachineModel::setWCSZero(const FloatPoint& p, bool x, bool y, bool z)
+{
+	if(!absolutePositionValid || activeWCS < 0)
+		return false;
+	int address = EEPROM_ADR_WCS_BASE+activeWCS*EEPROM_SIZE_WCS_VALUE;
+	FloatPoint offset = EEPROM_ReadFloatPoint(address);
+	FloatPoint zero = p+localZeroOffset;
+	if(x)
+	{
+		offset.x = zero.x;
+		localPosition.x -= p.x;
+		localZeroOffset.x = zero.x;
+	}
+	if(y)
+	{
+		offset.y = zero.y;
+		localPosition.y -= p.y;
+		localZeroOffset.y = zero.y;
+	}
+	if(z)
+	{
+		offset.z = zero.z;
+		localPosition.z -= p.z;
+		localZeroOffset.z = zero.z;
+	}
+	EEPROM_WriteFloatPoint(address, offset);
+	return true;
+}
@@ -24,8 +24,35 @@
 
 #include "Arduino.h"
 #include "configuration.h"
+#include "pins.h"
 #include "vectors.h"
 
+// Axes for electronic gearing
+enum {
+	kGearNone,
+	kGearX,
+	kGearY,
+	kGearZ,
+	kGearA,
+	kGearB
+};
+
+// Soft reset (real-time command, see HostSerial.h)
+enum {
+	kResetNone,
+	kResetRequested,	// Set by the receive interrupt
+	kResetDone			// The queues are cleared, the G-code processor still has to reset
+};
+
+// Actions of sync blocks in the queue (see qSync())
+enum {
+	kSyncEnableSteppers,
+	kSyncDisableSteppers,
+	kSyncSpindleOff,		// Same order as kSpindleOff, kSpindleCW, kSpindleCCW. The value is the PWM.
+	kSyncSpindleCW,
+	kSyncSpindleCCW
+};
+
 class cartesian_dda;
 class MachineModel
 {	
@@ -34,6 +61,10 @@ protected:
 	volatile byte head;
 	volatile byte tail;
 	
+	long tick;		// The current timer interval in microseconds
+	long mainDue;	// Time left until the cartesian_dda queue needs the next call
+	long indexDue;	// Same for the index channel
+	
 	bool led;
 
 	LongPoint zeroHit; //The coordinates of the last zero positions
@@ -43,14 +74,37 @@ protected:
 	// Machine States
 	bool using_mm;
 	bool abs_mode;					// false = incremental; true = absolute
+	bool inverse_time;				// false = units per minute (G94); true = inverse time (G93)
 	bool oldZRetractMode;			// false = return to R level in canned cycles; true = return to old Z level in canned cycles
 	int cutterRadiusCompensation;	// 0 = not active; 1 = compensate right of path; -1 = compensate left of path
+	int currentTool;				// 0 = unknown
+	int activeWCS;					// G54..G59 as 0..5, -1 = none (not selected yet, or G92, homing)
 	float retractHeight;			// for canned cycles
 	float clearanceIncrement;		// G73 relative retracting height between delta
+	float cylinderRadius;			// G7.1 cylindrical interpolation: 0 = not active; Y is unwrapped onto A otherwise
+	float cylinderY;				// The Y position the machine stays at during cylindrical interpolation
+	
+	byte gearMaster;				// Electronic gearing (M915): kGearNone = not active
+	byte gearSlave;
+	long gearNum;					// Slave steps per master step as a fraction
+	long gearDen;
+	long gearRemainder;				// The gearing accumulator after the last queued move
+	
+	byte outputs;					// Digital outputs (M62/M63), bit 0 = P0
+	byte pendingOutputsOn;			// Switched with the next move or dwell
+	byte pendingOutputsOff;
+	
+	unsigned long telemetryInterval;	// Milliseconds, 0 = off
+	unsigned long lastTelemetry;
 
 	void specialMoveX(const float& x, const float& feed);
 	void specialMoveY(const float& y, const float& feed);
 	void specialMoveZ(const float& z, const float& feed);
+	void qSegment(const FloatPoint& p, bool rapid = false);
+	
+	volatile bool stepping;				// handleInterrupt() is busy with the step counters
+	volatile bool probeLatchPending;	// The probe has triggered meanwhile
+	void latchProbe();
 
 public:
 	MachineModel();
@@ -62,6 +116,9 @@ public:
 	void blink();
 	
 	void manualToolChange(int toolNumber);
+	int getCurrentTool() { return currentTool; }
+	float toolDiameter(int toolNumber);
+	bool setToolDiameter(int toolNumber, float diameter);
 	
 	void setLocalZero(FloatPoint zeroPoint);
 	
@@ -73,8 +130,29 @@ public:
 	bool qFull();
 	void waitFor_qEmpty();
 	void waitFor_qNotFull();
-	void qMove(const FloatPoint& p);
+	void qMove(const FloatPoint& p, bool rapid = false);	// rapid: G0 and the like, the laser stays dark
+	bool probeMove(const FloatPoint& p, bool toContact = true);
+	FloatPoint probePosition();
+	void qDwell(unsigned long milliseconds);
+	void qSync(byte action, byte value = 0);
+	void syncAction(byte action, byte value);
+	
+	// Digital outputs, switched in order with the moves (M62/M63)
+	void qOutput(byte output, bool on);
+	void setOutputs(byte on, byte off);
+	byte getOutputs() { return outputs; }
 	void dQMove();
+	bool rotaryQueued();
+	byte qCount();
+	
+	// Telemetry (M905)
+	void setTelemetryRate(int hz);
+	void sendTelemetry();
+	
+	// The A/B index channel
+	void qIndexMove(const FloatPoint& p);
+	bool indexBusy();
+	void waitFor_indexIdle();
   	// True for mm; false for inches
 	void setUnits(bool u);
 	bool getUnits() { return using_mm; }
@@ -82,16 +160,32 @@ public:
 	
 	void setAbsMode(bool v) { abs_mode = v; }
 	bool getAbsMode() { return abs_mode; }
+	void setInverseTimeMode(bool v) { inverse_time = v; }
+	bool getInverseTimeMode() { return inverse_time; }
+	float feedDistance(const FloatPoint& delta);
 	void setRetractMode(bool v)  { oldZRetractMode = v; }
 	bool getRetractMode() { return oldZRetractMode; }
 	void setCutterRadiusCompensation(int v)  { cutterRadiusCompensation = v; }
 	int getCutterRadiusCompensation() { return cutterRadiusCompensation; }
 	float getClearanceIncrement() { return clearanceIncrement; }
+	void setCylindricalInterpolation(float radius);
+	float getCylinderRadius() { return cylinderRadius; }
+	FloatPoint toMachine(const FloatPoint& p);
+	
+	bool engageGear(byte slave, float slaveAmount, byte master, float masterAmount);
+	void disengageGear() { gearSlave = kGearNone; }
+	byte getGearSlave() { return gearSlave; }
+	byte getGearMaster() { return gearMaster; }
+	long getGearNum() { return gearNum; }
+	long getGearDen() { return gearDen; }
+	long gearSlaveSteps(long masterDelta, long& startAccumulator);
 	
 	void setRetractHeight(float v) { retractHeight = v; }
 	float getRetractHeight() { return retractHeight; }
 	
 	bool switchToWCS(int number);
+	int getActiveWCS() { return activeWCS; }
+	bool setWCSZero(const FloatPoint& p, bool x, bool y, bool z);
 	
 	void zeroX();
 	void zeroY();
@@ -104,6 +198,22 @@ public:
 	
 	// Emergency Stop
 	volatile bool emergencyStop;
+	
+	// Probing: the move of probeMove() slows down to a stop when the probe touches (or loses contact)
+	volatile bool probing;
+	volatile bool probeStopOn;		// The contact state which ends the move
+	volatile bool probeTriggered;
+	LongPoint probeSteps;			// Where it happened, latched by the probe interrupt
+	bool probeContact() { return PROBE_INVERTING ? !digitalRead(PROBE_PIN) : digitalRead(PROBE_PIN); }
+	void probeLatch();
+	
+	long currentLine;				// Line number of the command being executed (for the blocks it queues), -1 = none
+	
+	// Real-time commands
+	volatile bool feedHold;			// Slow down and stop while set, the queues are kept
+	volatile bool held;				// Stopped by the feed hold
+	volatile bool statusRequested;
+	volatile byte resetState;
 
 	bool receiving;
 	FloatPoint localPosition;
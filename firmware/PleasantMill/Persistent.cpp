@@ -24,13 +24,30 @@
 #include <EEPROM.h>
 #include "Arduino.h"
 #include "Persistent.h"
+#include "HostSerial.h"
  
 void checkEEPROM()
 {
    char ident0 = (char)EEPROM.read(EEPROM_ADR_IDENT);
    char ident1 = (char)EEPROM.read(EEPROM_ADR_IDENT+1);
    char ident2 = (char)EEPROM.read(EEPROM_ADR_IDENT+2);
-   if(ident0 != EEPROM_IDENTIFIER0 || ident1 != EEPROM_IDENTIFIER1 || ident2 != EEPROM_IDENTIFIER2) // EEPROM not initialized!
+   if(ident0 == EEPROM_IDENTIFIER0 && ident1 == EEPROM_IDENTIFIER1 && ident2 >= '4' && ident2 < EEPROM_IDENTIFIER2) // Older layout
+   {
+     // Keep WCS, tools and device name, only initialize what's new since then
+     switch(ident2)
+     {
+       case '4':
+         for(int i=0; i<TOOL_COUNT; i++)
+           EEPROM_WriteFloat(EEPROM_ADR_TOOL_DIAMETER_BASE+i*EEPROM_SIZE_TOOL_DIAMETER_VALUE, 0.);
+       case '5':
+         EEPROM_WriteLong(EEPROM_ADR_HOST_BAUD, HOST_BAUD);
+       case '6':
+         EEPROM.write(EEPROM_ADR_MESH_HEADER+4*sizeof(float), 0);
+         EEPROM.write(EEPROM_ADR_MESH_HEADER+4*sizeof(float)+1, 0);
+     }
+     EEPROM.write(EEPROM_ADR_IDENT+2, EEPROM_IDENTIFIER2);
+   }
+   else if(ident0 != EEPROM_IDENTIFIER0 || ident1 != EEPROM_IDENTIFIER1 || ident2 != EEPROM_IDENTIFIER2) // EEPROM not initialized!
    {
      // Initialize EEPROM with defaults
      
@@ -43,6 +60,11 @@ void checkEEPROM()
      char* nullString = "";
      for(int i=0; i<TOOL_COUNT; i++)
      	EEPROM_WriteString(EEPROM_ADR_TOOL_BASE+i*EEPROM_SIZE_TOOL_RECORD, nullString);
+     for(int i=0; i<TOOL_COUNT; i++)
+     	EEPROM_WriteFloat(EEPROM_ADR_TOOL_DIAMETER_BASE+i*EEPROM_SIZE_TOOL_DIAMETER_VALUE, 0.);
+     EEPROM_WriteLong(EEPROM_ADR_HOST_BAUD, HOST_BAUD);
+     EEPROM.write(EEPROM_ADR_MESH_HEADER+4*sizeof(float), 0);	// No height map
+     EEPROM.write(EEPROM_ADR_MESH_HEADER+4*sizeof(float)+1, 0);
           
 	 EEPROM_WriteString(EEPROM_ADR_DEVICENAME, "PleasantMill");
        
@@ -68,6 +90,31 @@ float EEPROM_ReadFloat(int address)
     return value;
 } 
 
+void EEPROM_WriteLong(int address, long value)
+{
+    byte* p = (byte*)(void*)&value;
+    for (int i = 0; i < sizeof(value); i++)
+	  EEPROM.write(address++, *p++);
+}
+
+long EEPROM_ReadLong(int address)
+{
+    long value = 0;
+    byte* p = (byte*)(void*)&value;
+    for (int i = 0; i < sizeof(value); i++)
+	  *p++ = EEPROM.read(address++);
+    return value;
+}
+
+long EEPROM_ReadHostBaud()
+{
+	char ident2 = (char)EEPROM.read(EEPROM_ADR_IDENT+2);
+	long baud = EEPROM_ReadLong(EEPROM_ADR_HOST_BAUD);
+	if(ident2 != EEPROM_IDENTIFIER2 || !HostSerial::baudSupported(baud))
+		return HOST_BAUD;
+	return baud;
+}
+
 void EEPROM_WriteFloatPoint(int address, FloatPoint value)
 {
 	EEPROM_WriteFloat(address, value.x);
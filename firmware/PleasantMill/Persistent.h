@@ -20,12 +20,13 @@
  * 
  */
  
+#include "configuration.h"
 #include "vectors.h"
 
  // EEPROM
 #define EEPROM_IDENTIFIER0 'P'
 #define EEPROM_IDENTIFIER1 'M'
-#define EEPROM_IDENTIFIER2 '4'
+#define EEPROM_IDENTIFIER2 '7'	// Layout version, see checkEEPROM() for the upgrade from older layouts
 
 #define EEPROM_ADR_IDENT 0
 #define EEPROM_SIZE_IDENT 3
@@ -42,12 +43,34 @@
 
 #define EEPROM_ADR_DEVICENAME (EEPROM_ADR_TOOL_BASE+EEPROM_SIZE_TOOL)
 #define EEPROM_SIZE_DEVICENAME 16
+
+// Since layout '5'
+#define EEPROM_ADR_TOOL_DIAMETER_BASE (EEPROM_ADR_DEVICENAME+EEPROM_SIZE_DEVICENAME)
+#define EEPROM_SIZE_TOOL_DIAMETER_VALUE sizeof(float)	// in mm
+#define EEPROM_SIZE_TOOL_DIAMETER (TOOL_COUNT*EEPROM_SIZE_TOOL_DIAMETER_VALUE)
+
+// Since layout '6'
+#define EEPROM_ADR_HOST_BAUD (EEPROM_ADR_TOOL_DIAMETER_BASE+EEPROM_SIZE_TOOL_DIAMETER)
+#define EEPROM_SIZE_HOST_BAUD sizeof(long)
+
+// Since layout '7': the height map of G29 (see HeightMap.h)
+#define EEPROM_ADR_MESH_HEADER (EEPROM_ADR_HOST_BAUD+EEPROM_SIZE_HOST_BAUD)
+#define EEPROM_SIZE_MESH_HEADER (4*sizeof(float)+2)	// Origin and spacing in mm, number of points in X and Y (0 = no map)
+#define EEPROM_ADR_MESH_BASE (EEPROM_ADR_MESH_HEADER+EEPROM_SIZE_MESH_HEADER)
+#define EEPROM_SIZE_MESH_VALUE sizeof(float)	// in mm
+#define EEPROM_SIZE_MESH (MESH_MAX_POINTS_X*MESH_MAX_POINTS_Y*EEPROM_SIZE_MESH_VALUE)
  
 void checkEEPROM();
 
 void EEPROM_WriteFloat(int address, float value);
 float EEPROM_ReadFloat(int address);
 
+void EEPROM_WriteLong(int address, long value);
+long EEPROM_ReadLong(int address);
+
+// The baud rate set by M906, HOST_BAUD if there is none
+long EEPROM_ReadHostBaud();
+
 void EEPROM_WriteFloatPoint(int address, FloatPoint value);
 FloatPoint EEPROM_ReadFloatPoint(int address);
 
@@ -33,6 +33,7 @@
 #include "hostcom.h"
 #include "MachineModel.h"
 #include "Persistent.h"
+#include "Spindle.h"
 
 hostcom talkToHost;
 MachineModel sharedMachineModel;
@@ -72,10 +73,13 @@ ISR(TIMER1_COMPA_vect)
   	sharedMachineModel.emergencyStop=true;
   }
   
-  if(!sharedMachineModel.emergencyStop)
+  // A soft reset stops the steps right away, the feed hold slows down first
+  if(!sharedMachineModel.emergencyStop && sharedMachineModel.resetState == kResetNone)
   {
   	sharedMachineModel.handleInterrupt();	
   }
+  if(sharedMachineModel.emergencyStop || sharedMachineModel.held || sharedMachineModel.resetState != kResetNone)
+  	spindle.holdLaser();	// No burning on the spot
   
   nonest = false;
 }
@@ -86,6 +90,7 @@ void setup()
   Serial1.begin(115200);
   Serial1.println("Hello Debugger");
 #endif  
+  checkEEPROM();	// The baud rate is stored there
   talkToHost.start();
   
   nonest = false;
@@ -95,8 +100,6 @@ void setup()
   pinMode(DEBUG_PIN, OUTPUT);
 
   setupGcodeProcessor();
-  
-  checkEEPROM();
 
   setTimer(DEFAULT_TICK);
   enableTimerInterrupt();
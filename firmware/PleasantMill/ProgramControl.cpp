@@ -0,0 +1,322 @@
+/************
+ * Subroutines and Loops (O-words)
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#include "ProgramControl.h"
+#include "Expression.h"
+
+ProgramControl programControl;
+const char* programError = "";
+
+// Longer names first where one starts with the other
+static const char* const kKeywords[] = { "ENDSUB", "SUB", "CALL", "RETURN", "ENDWHILE", "WHILE", "ENDREPEAT", "REPEAT" };
+static const byte kKeywordValues[] = { kOEndSub, kOSub, kOCall, kOReturn, kOEndWhile, kOWhile, kOEndRepeat, kORepeat };
+
+byte readOKeyword(const char*& p)
+{
+	while(*p == ' ')
+		p++;
+	for(byte i=0; i<sizeof(kKeywordValues); i++)
+	{
+		byte length = strlen(kKeywords[i]);
+		if(strncmp(p, kKeywords[i], length) == 0)
+		{
+			p += length;
+			return kKeywordValues[i];
+		}
+	}
+	return kONone;
+}
+
+// The O-number and keyword of a recorded line
+static byte lineOWord(const char* line, int& number)
+{
+	if(*line != 'O')
+		return kONone;
+	line++;
+	number = atoi(line);
+	while(*line >= '0' && *line <= '9')
+		line++;
+	return readOKeyword(line);
+}
+
+ProgramControl::ProgramControl()
+{
+	programEnd = 0;
+	subCount = 0;
+	recordNumber = -1;
+	loopStart = -1;
+	depth = 0;
+	pc = -1;
+}
+
+int ProgramControl::findSub(int number)
+{
+	for(byte i=0; i<subCount; i++)
+		if(subs[i].number == number)
+			return subs[i].start;
+	return -1;
+}
+
+bool ProgramControl::push(byte kind, int number, int position, long count)
+{
+	if(depth >= MAX_NESTING)
+	{
+		programError = "nested too deep";
+		return false;
+	}
+	stack[depth].kind = kind;
+	stack[depth].number = number;
+	stack[depth].position = position;
+	stack[depth].count = count;
+	depth++;
+	return true;
+}
+
+// An O-word line sent by the host (nothing is running or being recorded)
+bool ProgramControl::begin(const OWord& o, const char* line)
+{
+	switch(o.keyword)
+	{
+		case kOSub:
+			if(findSub(o.number) >= 0)
+			{
+				programError = "subroutine already defined";
+				return false;
+			}
+			if(subCount >= MAX_SUBROUTINES)
+			{
+				programError = "too many subroutines";
+				return false;
+			}
+			recordNumber = o.number;
+			recordKind = kOSub;
+			recordStart = programEnd;
+			return true;
+			
+		case kOWhile:
+		case kORepeat:
+			// The loop line is part of the block, it's evaluated when the loop runs
+			recordNumber = o.number;
+			recordKind = o.keyword;
+			recordStart = programEnd;
+			return record(line);
+			
+		case kOCall:
+			depth = 0;
+			lineStart = -1;
+			pc = -1;		// Return to the host
+			return control(o);
+	}
+	programError = "O-word outside of a sub or loop";
+	return false;
+}
+
+// Store a line while recording. Line number, checksum and spaces are dropped.
+bool ProgramControl::record(const char* line)
+{
+	while(*line == ' ')
+		line++;
+	if(*line == 'N')
+	{
+		line++;
+		while((*line >= '0' && *line <= '9') || *line == ' ')
+			line++;
+	}
+	
+	int start = programEnd;
+	int brackets = 0;
+	for(; *line && (*line != '*' || brackets > 0); line++)	// A * outside of brackets starts the checksum
+	{
+		if(*line == '[')
+			brackets++;
+		else if(*line == ']' && brackets > 0)
+			brackets--;
+		if(*line == ' ')
+			continue;
+		if(programEnd >= PROGRAM_SIZE-1)
+		{
+			programEnd = recordStart;		// Throw away the whole block
+			recordNumber = -1;
+			programError = "out of program memory";
+			return false;
+		}
+		program[programEnd++] = *line;
+	}
+	if(programEnd == start)
+		return true;	// Empty line
+	program[programEnd++] = 0;
+	
+	int number = -1;
+	byte keyword = lineOWord(program+start, number);
+	if(number != recordNumber)
+		return true;
+	if(recordKind == kOSub && keyword == kOEndSub)
+	{
+		subs[subCount].number = recordNumber;
+		subs[subCount].start = recordStart;
+		subCount++;
+		recordNumber = -1;
+	}
+	else if((recordKind == kOWhile && keyword == kOEndWhile) || (recordKind == kORepeat && keyword == kOEndRepeat))
+	{
+		// Run the loop now
+		recordNumber = -1;
+		loopStart = recordStart;
+		depth = 0;
+		pc = recordStart;
+	}
+	return true;
+}
+
+// The next line to run, 0 when done
+const char* ProgramControl::nextLine()
+{
+	if(pc < 0 || pc >= programEnd)
+	{
+		finish();
+		return 0;
+	}
+	lineStart = pc;
+	const char* line = program+pc;
+	pc += strlen(line)+1;
+	return line;
+}
+
+void ProgramControl::finish()
+{
+	pc = -1;
+	depth = 0;
+	if(loopStart >= 0)
+	{
+		programEnd = loopStart;
+		loopStart = -1;
+	}
+}
+
+void ProgramControl::abort()
+{
+	finish();
+	if(recordNumber >= 0)
+	{
+		programEnd = recordStart;
+		recordNumber = -1;
+	}
+}
+
+// Continue after the line "O<number> <keyword>"
+bool ProgramControl::skipPast(int number, byte keyword)
+{
+	while(pc < programEnd)
+	{
+		int n = -1;
+		byte k = lineOWord(program+pc, n);
+		pc += strlen(program+pc)+1;
+		if(n == number && k == keyword)
+			return true;
+	}
+	programError = "end of block not found";
+	return false;
+}
+
+// An O-word line while running (or a call from the host)
+bool ProgramControl::control(const OWord& o)
+{
+	switch(o.keyword)
+	{
+		case kOCall:
+			{
+				int start = findSub(o.number);
+				if(start < 0)
+				{
+					programError = "unknown subroutine";
+					return false;
+				}
+				if(!push(kOCall, o.number, pc, 0))
+					return false;
+				for(byte i=0; i<o.argCount; i++)
+					setParameter(i+1, o.args[i]);
+				pc = start;
+			}
+			return true;
+			
+		case kOReturn:
+		case kOEndSub:
+			while(depth > 0 && stack[depth-1].kind != kOCall)
+				depth--;
+			if(depth == 0)
+			{
+				programError = "return outside of a subroutine";
+				return false;
+			}
+			depth--;
+			pc = stack[depth].position;
+			if(pc < 0)
+				finish();
+			return true;
+			
+		case kOWhile:
+			{
+				bool looping = (depth > 0 && stack[depth-1].kind == kOWhile && stack[depth-1].number == o.number);
+				if(o.argCount < 1)
+				{
+					programError = "while needs a condition";
+					return false;
+				}
+				if(o.args[0] != 0.)
+					return looping || push(kOWhile, o.number, lineStart, 0);
+				if(looping)
+					depth--;
+				return skipPast(o.number, kOEndWhile);
+			}
+			
+		case kOEndWhile:
+			if(depth == 0 || stack[depth-1].kind != kOWhile || stack[depth-1].number != o.number)
+			{
+				programError = "endwhile without while";
+				return false;
+			}
+			pc = stack[depth-1].position;	// Check the condition again
+			return true;
+			
+		case kORepeat:
+			{
+				long count = (o.argCount > 0) ? (long)o.args[0] : 0;
+				if(count > 0)
+					return push(kORepeat, o.number, pc, count);
+				return skipPast(o.number, kOEndRepeat);
+			}
+			
+		case kOEndRepeat:
+			if(depth == 0 || stack[depth-1].kind != kORepeat || stack[depth-1].number != o.number)
+			{
+				programError = "endrepeat without repeat";
+				return false;
+			}
+			if(--stack[depth-1].count > 0)
+				pc = stack[depth-1].position;
+			else
+				depth--;
+			return true;
+	}
+	programError = "sub inside of a running program";
+	return false;
+}
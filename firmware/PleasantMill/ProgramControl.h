@@ -0,0 +1,120 @@
+/************
+ * Subroutines and Loops (O-words)
+ *
+ *   O100 sub ... O100 endsub        Define subroutine 100 (kept in RAM)
+ *   O100 call [1] [#5*2]            Call it, the arguments go into #1, #2, ...
+ *   O100 return                     Return early
+ *   O101 while [#1 LT 10] ... O101 endwhile
+ *   O102 repeat [5] ... O102 endrepeat
+ *
+ * The lines of a subroutine are recorded (and acknowledged) as they come
+ * in. A loop sent by the host is recorded up to its end, then it runs.
+ * Running lines are fed into the G-code processor like received lines,
+ * meanwhile the host's lines wait in the receive buffer. Parameters and
+ * conditions are evaluated as the lines are read, ahead of the motion.
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#ifndef PROGRAMCONTROL_H
+#define PROGRAMCONTROL_H
+
+#include "Arduino.h"
+#include "configuration.h"
+
+#define MAX_CALL_ARGS 5
+
+enum {
+	kONone,
+	kOSub,
+	kOEndSub,
+	kOCall,
+	kOReturn,
+	kOWhile,
+	kOEndWhile,
+	kORepeat,
+	kOEndRepeat
+};
+
+// An O-word line, as found by the G-code processor
+struct OWord
+{
+	int number;
+	byte keyword;
+	float args[MAX_CALL_ARGS];
+	byte argCount;
+};
+
+class ProgramControl
+{
+private:
+	char program[PROGRAM_SIZE];	// Lines, 0 terminated, one after the other
+	int programEnd;
+
+	struct Subroutine
+	{
+		int number;
+		int start;
+	};
+	Subroutine subs[MAX_SUBROUTINES];
+	byte subCount;
+
+	int recordNumber;			// The O-number of the block being recorded, -1 = none
+	byte recordKind;			// kOSub, kOWhile or kORepeat
+	int recordStart;
+	int loopStart;				// The running loop sent by the host, freed afterwards. -1 = none
+
+	struct Frame
+	{
+		byte kind;				// kOCall, kOWhile or kORepeat
+		int number;
+		int position;			// Return address, the while line or the line after repeat
+		long count;
+	};
+	Frame stack[MAX_NESTING];
+	byte depth;
+
+	int pc;						// The next line to run, -1 = not running
+	int lineStart;				// The line which is running
+
+	int findSub(int number);
+	bool push(byte kind, int number, int position, long count);
+	bool skipPast(int number, byte keyword);
+	void finish();
+
+public:
+	ProgramControl();
+
+	bool recording() { return recordNumber >= 0; }
+	bool running() { return pc >= 0; }
+
+	bool begin(const OWord& o, const char* line);
+	bool record(const char* line);
+	const char* nextLine();
+	bool control(const OWord& o);
+	void abort();
+};
+
+extern ProgramControl programControl;
+extern const char* programError;
+
+// The keyword of an O-word at p, kONone if there is none. Advances p.
+byte readOKeyword(const char*& p);
+
+#endif
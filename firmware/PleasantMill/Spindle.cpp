@@ -0,0 +1,126 @@
+/************
+ * Spindle
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#include "Spindle.h"
+#include "MachineModel.h"
+
+Spindle spindle;
+
+Spindle::Spindle()
+{
+	direction = kSpindleOff;
+	speed = 0.;
+	laserMode = false;
+	laserHeld = false;
+}
+
+void Spindle::startup()
+{
+	pinMode(SPINDLE_ENABLE_PIN, OUTPUT);
+	pinMode(SPINDLE_DIR_PIN, OUTPUT);
+	pinMode(SPINDLE_PWM_PIN, OUTPUT);
+	apply(kSpindleOff, 0);
+}
+
+// The PWM value for a speed, full speed at SPINDLE_MAX_RPM
+byte Spindle::pwm(float rpm)
+{
+	if(rpm <= 0.)
+		return 0;
+	if(rpm >= SPINDLE_MAX_RPM)
+		return 255;
+	return (byte)(rpm*255./SPINDLE_MAX_RPM + 0.5);
+}
+
+// Queue the switch and a dwell for the spindle to get from one speed to the other
+void Spindle::queueSwitch(byte newDirection, float fromSpeed, float toSpeed)
+{
+	sharedMachineModel.qSync(kSyncSpindleOff+newDirection, pwm(toSpeed));
+	float change = (toSpeed - fromSpeed)/SPINDLE_MAX_RPM;
+	unsigned long wait;
+	if(change > 0.)
+		wait = (unsigned long)(min(change, 1.)*SPINDLE_SPINUP_TIME);
+	else
+		wait = (unsigned long)(min(-change, 1.)*SPINDLE_SPINDOWN_TIME);
+	if(wait && !laserMode)
+		sharedMachineModel.qDwell(wait);
+}
+
+// S word: only a running spindle has to be told
+void Spindle::setSpeed(float rpm)
+{
+	if(rpm < 0.)
+		rpm = 0.;
+	if(rpm == speed)
+		return;
+	speed = rpm;
+	if(direction != kSpindleOff && !laserMode)	// The laser's moves carry their power
+		sharedMachineModel.qSync(kSyncSpindleOff+direction, pwm(speed));
+}
+
+// M3/M4: Nothing to wait for if it already runs that way
+void Spindle::start(byte newDirection)
+{
+	if(newDirection == direction)
+		return;
+	if(direction != kSpindleOff)
+		queueSwitch(kSpindleOff, speed, 0.);	// Reverse: stop first
+	queueSwitch(newDirection, 0., speed);
+	direction = newDirection;
+}
+
+// M5
+void Spindle::stop()
+{
+	if(direction == kSpindleOff)
+		return;
+	queueSwitch(kSpindleOff, speed, 0.);
+	direction = kSpindleOff;
+}
+
+// The laser power of a feed move, 0 = dark
+byte Spindle::laserPwm()
+{
+	if(!laserMode || direction == kSpindleOff)
+		return 0;
+	return pwm(speed);
+}
+
+// Soft reset and shutdown: off right now, the queue is gone anyway
+void Spindle::cancel()
+{
+	direction = kSpindleOff;
+	apply(kSpindleOff, 0);
+}
+
+void Spindle::apply(byte newDirection, byte newPwm)
+{
+	if(newDirection == kSpindleOff)
+	{
+		analogWrite(SPINDLE_PWM_PIN, 0);
+		digitalWrite(SPINDLE_ENABLE_PIN, !SPINDLE_ENABLE_ON);
+		return;
+	}
+	digitalWrite(SPINDLE_DIR_PIN, (newDirection == kSpindleCCW) ? 1 : 0);
+	analogWrite(SPINDLE_PWM_PIN, laserMode ? 0 : newPwm);
+	digitalWrite(SPINDLE_ENABLE_PIN, SPINDLE_ENABLE_ON);
+}
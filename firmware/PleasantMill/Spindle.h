@@ -0,0 +1,92 @@
+/************
+ * Spindle
+ *
+ * M3/M4/M5 and the S word. The spindle is switched by sync blocks, in
+ * order with the moves. When it starts, stops or reverses, a dwell is
+ * queued behind the switch, long enough for the spindle to get to its
+ * new speed (SPINDLE_SPINUP_TIME/SPINDLE_SPINDOWN_TIME are for the full
+ * speed range). A new speed while it runs changes the PWM without waiting.
+ *
+ * Laser mode (M907 S1): M3/M4/M5 switch without a dwell, and the laser only
+ * fires during feed moves. Each move carries its power (see cartesian_dda),
+ * which the step interrupt scales by the current speed over the programmed
+ * feed, so ease-in and ease-out don't burn the corners. Rapids (rapidMove(),
+ * jogging, homing), dwells, feed hold and emergency stop leave it dark.
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#ifndef SPINDLE_H
+#define SPINDLE_H
+
+#include "Arduino.h"
+#include "configuration.h"
+#include "pins.h"
+
+enum {
+	kSpindleOff,
+	kSpindleCW,		// M3
+	kSpindleCCW		// M4
+};
+
+class Spindle
+{
+private:
+	// As planned, i.e. at the end of the queue
+	byte direction;
+	float speed;			// rpm, the last S word
+	bool laserMode;
+
+	byte pwm(float rpm);
+	void queueSwitch(byte newDirection, float fromSpeed, float toSpeed);
+
+public:
+	Spindle();
+
+	void startup();
+	void setSpeed(float rpm);
+	void start(byte newDirection);
+	void stop();
+	void cancel();
+
+	byte getDirection() { return direction; }
+	float getSpeed() { return speed; }
+	
+	void setLaserMode(bool on) { laserMode = on; }
+	bool getLaserMode() { return laserMode; }
+	byte laserPwm();		// Of a feed move
+
+	// Called from the timer interrupt by the sync block
+	void apply(byte newDirection, byte newPwm);
+	
+	// Called from the timer interrupt while the moves stand still (feed hold, emergency stop)
+	void holdLaser()
+	{
+		if(laserMode && !laserHeld)
+		{
+			analogWrite(SPINDLE_PWM_PIN, 0);
+			laserHeld = true;
+		}
+	}
+	volatile bool laserHeld;	// The running move has to set its power again
+};
+
+extern Spindle spindle;
+
+#endif
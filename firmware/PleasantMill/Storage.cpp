@@ -0,0 +1,287 @@
+/************
+ * Job Storage
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#include "Storage.h"
+
+Storage storage;
+
+Storage::Storage()
+{
+	isMounted = false;
+	isOpen = false;
+#if !defined(STORAGE_SD) && STORAGE_AVAILABLE
+	file = 0;
+	directory = 0;
+	fileSize = 0;
+#endif
+}
+
+#if defined(STORAGE_SD)
+
+// SD card on the SPI bus
+
+bool Storage::mount()
+{
+	if(!isMounted)
+		isMounted = SD.begin(SD_CS_PIN);
+	return isMounted;
+}
+
+void Storage::unmount()
+{
+	close();
+	if(directory)
+		directory.close();
+	isMounted = false;
+}
+
+bool Storage::openRead(const char* name)
+{
+	close();
+	file = SD.open(name, FILE_READ);
+	isOpen = file && !file.isDirectory();
+	return isOpen;
+}
+
+bool Storage::openWrite(const char* name)
+{
+	close();
+	if(SD.exists((char*)name))
+		SD.remove((char*)name);
+	file = SD.open(name, FILE_WRITE);
+	isOpen = file;
+	return isOpen;
+}
+
+void Storage::close()
+{
+	if(isOpen)
+		file.close();
+	isOpen = false;
+}
+
+int Storage::read()
+{
+	return isOpen ? file.read() : -1;
+}
+
+bool Storage::write(const char* data, int length)
+{
+	return isOpen && file.write((const uint8_t*)data, length) == (size_t)length;
+}
+
+long Storage::size()
+{
+	return isOpen ? file.size() : 0;
+}
+
+long Storage::position()
+{
+	return isOpen ? file.position() : 0;
+}
+
+bool Storage::seek(long position)
+{
+	return isOpen && file.seek(position);
+}
+
+bool Storage::remove(const char* name)
+{
+	return SD.remove((char*)name);
+}
+
+bool Storage::firstEntry(char* name, long& size)
+{
+	if(directory)
+		directory.close();
+	directory = SD.open("/");
+	if(!directory)
+		return false;
+	directory.rewindDirectory();
+	return nextEntry(name, size);
+}
+
+bool Storage::nextEntry(char* name, long& size)
+{
+	for(;;)
+	{
+		File entry = directory.openNextFile();
+		if(!entry)
+		{
+			directory.close();
+			return false;
+		}
+		bool isFile = !entry.isDirectory();
+		if(isFile)
+		{
+			strncpy(name, entry.name(), STORAGE_NAME_SIZE-1);
+			name[STORAGE_NAME_SIZE-1] = 0x0;
+			size = entry.size();
+		}
+		entry.close();
+		if(isFile)
+			return true;
+	}
+}
+
+#elif STORAGE_AVAILABLE
+
+// Host build: the files of STORAGE_DIRECTORY stand in for the card
+
+const char* Storage::path(const char* name)
+{
+	static char buffer[sizeof(STORAGE_DIRECTORY)+STORAGE_NAME_SIZE+1];
+	snprintf(buffer, sizeof(buffer), "%s/%s", STORAGE_DIRECTORY, name);
+	return buffer;
+}
+
+bool Storage::mount()
+{
+	isMounted = true;
+	return true;
+}
+
+void Storage::unmount()
+{
+	close();
+	if(directory)
+		closedir(directory);
+	directory = 0;
+	isMounted = false;
+}
+
+bool Storage::openRead(const char* name)
+{
+	close();
+	file = fopen(path(name), "rb");
+	isOpen = (file != 0);
+	if(isOpen)
+	{
+		fseek(file, 0, SEEK_END);
+		fileSize = ftell(file);
+		fseek(file, 0, SEEK_SET);
+	}
+	return isOpen;
+}
+
+bool Storage::openWrite(const char* name)
+{
+	close();
+	file = fopen(path(name), "wb");
+	isOpen = (file != 0);
+	fileSize = 0;
+	return isOpen;
+}
+
+void Storage::close()
+{
+	if(isOpen)
+		fclose(file);
+	file = 0;
+	isOpen = false;
+}
+
+int Storage::read()
+{
+	return isOpen ? fgetc(file) : -1;
+}
+
+bool Storage::write(const char* data, int length)
+{
+	if(!isOpen || fwrite(data, 1, length, file) != (size_t)length)
+		return false;
+	fileSize += length;
+	return true;
+}
+
+long Storage::size()
+{
+	return isOpen ? fileSize : 0;
+}
+
+long Storage::position()
+{
+	return isOpen ? ftell(file) : 0;
+}
+
+bool Storage::seek(long position)
+{
+	return isOpen && position >= 0 && position <= fileSize && fseek(file, position, SEEK_SET) == 0;
+}
+
+bool Storage::remove(const char* name)
+{
+	return ::remove(path(name)) == 0;
+}
+
+bool Storage::firstEntry(char* name, long& size)
+{
+	if(directory)
+		closedir(directory);
+	directory = opendir(STORAGE_DIRECTORY);
+	if(!directory)
+		return false;
+	return nextEntry(name, size);
+}
+
+bool Storage::nextEntry(char* name, long& size)
+{
+	if(!directory)
+		return false;
+	struct dirent* entry;
+	while((entry = readdir(directory)) != 0)
+	{
+		if(entry->d_name[0] == '.' || strlen(entry->d_name) >= STORAGE_NAME_SIZE)
+			continue;
+		FILE* f = fopen(path(entry->d_name), "rb");
+		if(!f)
+			continue;
+		fseek(f, 0, SEEK_END);
+		size = ftell(f);
+		fclose(f);
+		strcpy(name, entry->d_name);
+		return true;
+	}
+	closedir(directory);
+	directory = 0;
+	return false;
+}
+
+#else
+
+// No storage configured: every request fails
+
+bool Storage::mount() { return false; }
+void Storage::unmount() {}
+bool Storage::openRead(const char* name) { return false; }
+bool Storage::openWrite(const char* name) { return false; }
+void Storage::close() {}
+int Storage::read() { return -1; }
+bool Storage::write(const char* data, int length) { return false; }
+long Storage::size() { return 0; }
+long Storage::position() { return 0; }
+bool Storage::seek(long position) { return false; }
+bool Storage::remove(const char* name) { return false; }
+bool Storage::firstEntry(char* name, long& size) { return false; }
+bool Storage::nextEntry(char* name, long& size) { return false; }
+
+#endif
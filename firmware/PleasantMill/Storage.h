@@ -0,0 +1,95 @@
+/************
+ * Job Storage
+ *
+ * Files on an SD card (STORAGE_SD in configuration.h) for jobs which are
+ * uploaded first (M28/M29) and then run from the board (M23/M24), so the
+ * host's latency doesn't matter while the machine works. Host builds (no
+ * ARDUINO defined) use the files of STORAGE_DIRECTORY instead.
+ *
+ * Only one file is open at a time, either for reading or for writing.
+ *
+ * "Pleasant Mill" Firmware
+ * Copyright (c) 2011 Eberhard Rensch, Pleasant Software, Offenburg
+ * All rights reserved.
+ * http://pleasantsoftware.com/developer/3d/pleasant-mill/
+ *
+ *  This program is free software; you can redistribute it and/or modify it under
+ *  the terms of the GNU General Public License as published by the Free Software
+ *  Foundation; either version 3 of the License, or (at your option) any later
+ *  version.
+ *
+ *  This program is distributed in the hope that it will be useful, but WITHOUT ANY
+ *  WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR A
+ *  PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License along with
+ *  this program; if not, see <http://www.gnu.org/licenses>.
+ *
+ */
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include "Arduino.h"
+#include "configuration.h"
+#include "pins.h"
+
+#if defined(STORAGE_SD)
+#include <SD.h>
+#define STORAGE_AVAILABLE 1
+#elif !defined(ARDUINO)
+#include <stdio.h>
+#include <dirent.h>
+#define STORAGE_AVAILABLE 1
+#ifndef STORAGE_DIRECTORY
+#define STORAGE_DIRECTORY "."
+#endif
+#else
+#define STORAGE_AVAILABLE 0
+#endif
+
+#define STORAGE_NAME_SIZE 13	// 8.3 names
+
+class Storage
+{
+private:
+	bool isMounted;
+	bool isOpen;
+#if defined(STORAGE_SD)
+	File file;
+	File directory;
+#elif STORAGE_AVAILABLE
+	FILE* file;
+	DIR* directory;
+	long fileSize;
+	const char* path(const char* name);
+#endif
+
+public:
+	Storage();
+
+	bool mount();
+	void unmount();
+	bool mounted() { return isMounted; }
+
+	bool openRead(const char* name);
+	bool openWrite(const char* name);	// Replaces an existing file
+	void close();
+	bool open() { return isOpen; }
+
+	int read();							// The next byte, -1 at the end of the file
+	bool write(const char* data, int length);
+	long size();
+	long position();
+	bool seek(long position);
+
+	bool remove(const char* name);
+
+	// The files of the root directory, one after the other
+	bool firstEntry(char* name, long& size);
+	bool nextEntry(char* name, long& size);
+};
+
+extern Storage storage;
+
+#endif
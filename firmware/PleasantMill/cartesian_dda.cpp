@@ -33,12 +33,25 @@
 #include "vectors.h"
 #include "cartesian_dda.h"
 #include "interruptHandling.h"
+#include "Spindle.h"
+#include "HeightMap.h"
+
+#define MAX_DWELL_TICK 1000000L	// Dwells are timed in steps of up to 1s, well within the timer's range
 
 
 cartesian_dda::cartesian_dda()
 {
 	live = false;
 	nullmove = false;
+	kind = kMoveBlock;
+	line_nr = -1;
+	outputs_on = 0;
+	outputs_off = 0;
+	laser_pwm = 0;
+	timestep = DEFAULT_TICK;
+	gear_master = kGearNone;
+	gear_slave = kGearNone;
+	gear_steps = 0;
         
 	// Default is going forward
 	x_direction = true;
@@ -107,8 +120,13 @@ cartesian_dda::cartesian_dda()
 	
 }
 
-void cartesian_dda::set_target(const FloatPoint& p)
+void cartesian_dda::set_target(const FloatPoint& p, bool rapid)
 {
+	kind = kMoveBlock;
+	line_nr = sharedMachineModel.currentLine;
+	outputs_on = 0;
+	outputs_off = 0;
+	laser_pwm = rapid ? 0 : spindle.laserPwm();
 	stepsMade = 0;
 	target_position = p;
 	nullmove = false;
@@ -118,27 +136,61 @@ void cartesian_dda::set_target(const FloatPoint& p)
 	//figure our deltas.
 	delta_position = fabsv(target_position - locPos);
         
-	// The feedrate values refer to distance in (X, Y, Z) space, so ignore e and f
+	// The feedrate values refer to distance in (X, Y, Z) space, so ignore a, b and f
 	// values unless they're the only thing there.
-	FloatPoint squares = delta_position*delta_position;
-	distance = squares.x + squares.y + squares.z;
+	distance = sharedMachineModel.feedDistance(delta_position);
 	
-	// If we are 0, only thing changing is a
-	if(distance < SMALL_DISTANCE2)
-		distance = squares.a;
-	// If we are 0, only thing changing is b
-	if(distance < SMALL_DISTANCE2)
-		distance = squares.b;
 	// If we are still 0, only thing changing is f
-	if(distance < SMALL_DISTANCE2)
-		distance = squares.f;
-	distance = sqrt(distance);          
+	if(distance < SMALL_DISTANCE)
+		distance = delta_position.f;
                                                                                    			
 	//set our steps current, target, and delta
-	FloatPoint units = sharedMachineModel.returnUnits();
+	units = sharedMachineModel.returnUnits();
+	zero_offset = sharedMachineModel.localZeroOffset;
+	
+	// The distance above is measured in program coordinates, the steps are taken in machine coordinates
+	FloatPoint machineFrom = sharedMachineModel.toMachine(locPos);
+	FloatPoint machineTo = sharedMachineModel.toMachine(target_position);
 				
-	current_steps = to_steps(units, locPos+sharedMachineModel.localZeroOffset); // Calculate Steps always absolute, this enables us to determine virtual endstop hits
-	target_steps = to_steps(units, target_position+sharedMachineModel.localZeroOffset);
+	current_steps = to_steps(units, machineFrom+zero_offset); // Calculate Steps always absolute, this enables us to determine virtual endstop hits
+	target_steps = to_steps(units, machineTo+zero_offset);
+	
+	// Height map (G29, M420): Z ends above the surface, the move starts where the last one has left it
+	current_steps.z += heightMap.queuedOffset;
+	heightMap.queuedOffset = heightMap.offsetSteps(target_steps.x, target_steps.y);
+	target_steps.z += heightMap.queuedOffset;
+	
+	// Electronic gearing: the slave isn't part of the DDA, it follows the master's steps (see gear_follow())
+	gear_slave = sharedMachineModel.getGearSlave();
+	gear_master = kGearNone;
+	gear_steps = 0;
+	if(gear_slave != kGearNone)
+	{
+		gear_master = sharedMachineModel.getGearMaster();
+		gear_num = sharedMachineModel.getGearNum();
+		gear_den = sharedMachineModel.getGearDen();
+		long masterDelta;
+		switch(gear_master)
+		{
+			case kGearX: masterDelta = target_steps.x - current_steps.x; break;
+			case kGearY: masterDelta = target_steps.y - current_steps.y; break;
+			default:     masterDelta = target_steps.z - current_steps.z; break;
+		}
+		long slaveSteps = sharedMachineModel.gearSlaveSteps(masterDelta, gear_acc);
+		gear_direction = (slaveSteps >= 0);
+		gear_steps = abs(slaveSteps);
+		if(gear_slave == kGearA)
+		{
+			target_steps.a = current_steps.a;
+			target_position.a = locPos.a + slaveSteps/units.a;
+		}
+		else
+		{
+			target_steps.b = current_steps.b;
+			target_position.b = locPos.b + slaveSteps/units.b;
+		}
+	}
+	
 	delta_steps = absv(target_steps - current_steps);
 
 //	Serial.print("locX:");
@@ -172,7 +224,7 @@ void cartesian_dda::set_target(const FloatPoint& p)
 	if(total_steps == 0)
 	{
 		nullmove = true;
-		sharedMachineModel.localPosition=p;
+		sharedMachineModel.localPosition=target_position;
 	}    
 	else
 	{
@@ -197,6 +249,7 @@ void cartesian_dda::set_target(const FloatPoint& p)
 			t_scale = 1;
 			delta_steps.f=total_steps/EASE_INTERLEAF;
 		}
+		easeOutPlanned = easeOutTrigger;
 			
 	//		Serial.print("TotalSteps ");
 	//		Serial.println(total_steps);
@@ -234,12 +287,19 @@ void cartesian_dda::set_target(const FloatPoint& p)
 #endif
 		//what is our direction?
         
-		x_direction = (target_position.x >= locPos.x);
-		y_direction = (target_position.y >= locPos.y);
-		z_direction = (target_position.z >= locPos.z);
-        a_direction = (target_position.a >= locPos.a);
-        b_direction = (target_position.b >= locPos.b);
-		f_direction = (target_position.f >= locPos.f);
+		x_direction = (machineTo.x >= machineFrom.x);
+		y_direction = (machineTo.y >= machineFrom.y);
+		z_direction = (target_steps.z >= current_steps.z);	// The height map may turn it around
+        a_direction = (machineTo.a >= machineFrom.a);
+        b_direction = (machineTo.b >= machineFrom.b);
+		f_direction = (machineTo.f >= machineFrom.f);
+		if(gear_steps)
+		{
+			if(gear_slave == kGearA)
+				a_direction = gear_direction;
+			else
+				b_direction = gear_direction;
+		}
 
 
 		dda_counter.x = -total_steps/2;
@@ -249,18 +309,74 @@ void cartesian_dda::set_target(const FloatPoint& p)
         dda_counter.b = dda_counter.x;
         dda_counter.f = dda_counter.x;
   
-        sharedMachineModel.localPosition=p;
+        sharedMachineModel.localPosition=target_position;
 	}
 }
 
+// A dwell is timed by the step timer, the machine doesn't move
+
+void cartesian_dda::set_dwell(unsigned long milliseconds)
+{
+	kind = kDwellBlock;
+	line_nr = sharedMachineModel.currentLine;
+	outputs_on = 0;
+	outputs_off = 0;
+	laser_pwm = 0;
+	nullmove = (milliseconds == 0);
+	timestep = DEFAULT_TICK;
+	dwell_left = milliseconds*1000L;
+	units = sharedMachineModel.returnUnits();
+	zero_offset = sharedMachineModel.localZeroOffset;
+	hold_position();
+}
+
+// Dwell and sync blocks stand where the block before them has left the machine (telemetry)
+void cartesian_dda::hold_position()
+{
+	current_steps = to_steps(units, sharedMachineModel.toMachine(sharedMachineModel.localPosition)+zero_offset);
+	current_steps.z += heightMap.queuedOffset;
+}
+
+void cartesian_dda::set_sync(byte action, byte value)
+{
+	kind = kSyncBlock;
+	line_nr = sharedMachineModel.currentLine;
+	outputs_on = 0;
+	outputs_off = 0;
+	laser_pwm = 0;
+	nullmove = false;
+	timestep = DEFAULT_TICK;
+	sync_action = action;
+	sync_value = value;
+	units = sharedMachineModel.returnUnits();
+	zero_offset = sharedMachineModel.localZeroOffset;
+	hold_position();
+}
+
 // This function is called by an interrupt.  Consequently interrupts are off for the duration
 // of its execution.  Consequently it has to be as optimised and as fast as possible.
 
 
 void cartesian_dda::dda_step()
 {  
-	if(live)
+	if(live && kind == kDwellBlock)
+	{
+		dwell_left -= timestep;
+		if(dwell_left > 0)
+			timestep = min(dwell_left, MAX_DWELL_TICK);
+		else
+		{
+			live = false;
+			timestep = DEFAULT_TICK;
+		}
+	}
+	else if(live)
 	{
+#if EASEINOUT
+		// Feed hold: ease out right away, MachineModel::handleInterrupt() stops at the slow feedrate
+		if(sharedMachineModel.feedHold && easeOutTrigger > stepsMade)
+			easeOutTrigger = stepsMade;
+#endif
 		do
 		{
 			x_can_step = xCanStep(current_steps.x, target_steps.x, x_direction);
@@ -269,6 +385,20 @@ void cartesian_dda::dda_step()
 			a_can_step = aCanStep(current_steps.a, target_steps.a, a_direction);
 			b_can_step = bCanStep(current_steps.b, target_steps.b, b_direction);
 			
+			// Probing: the probe interrupt has latched the position. Slow down (ease-out) and stop.
+			if(sharedMachineModel.probing && sharedMachineModel.probeTriggered)
+			{
+#if EASEINOUT
+				if(easeOutTrigger > stepsMade)
+					easeOutTrigger = stepsMade;
+				if(current_steps.f <= slowSteps)
+#endif
+				{
+					x_can_step = y_can_step = z_can_step = a_can_step = b_can_step = f_can_step = false;
+					break;
+				}
+			}
+			
 			if(stepsMade>easeOutTrigger)
 				f_can_step = fCanStep(current_steps.f, slowSteps, f_direction);
             else
@@ -283,6 +413,8 @@ void cartesian_dda::dda_step()
 					do_x_step();
 					real_move = true;
 					dda_counter.x -= total_steps;
+					if(gear_steps && gear_master == kGearX)
+						gear_follow(x_direction);
 				
 					if (x_direction)
 						current_steps.x++;
@@ -299,6 +431,8 @@ void cartesian_dda::dda_step()
 					do_y_step();
 					real_move = true;
 					dda_counter.y -= total_steps;
+					if(gear_steps && gear_master == kGearY)
+						gear_follow(y_direction);
 
 					if (y_direction)
 						current_steps.y++;
@@ -315,6 +449,8 @@ void cartesian_dda::dda_step()
 					do_z_step();
 					real_move = true;
 					dda_counter.z -= total_steps;
+					if(gear_steps && gear_master == kGearZ)
+						gear_follow(z_direction);
 
 					if (z_direction)
 						current_steps.z++;
@@ -407,8 +543,9 @@ void cartesian_dda::dda_step()
 			{
 				timestep = t_scale*current_steps.f;
 				timestep = calculate_feedrate_delay((float) timestep);
-				setTimer(timestep);
 			}
+			if(laser_pwm && real_move && (feed_change || spindle.laserHeld))
+				laser_power();
 			feed_change = false;
 		} while (!real_move && f_can_step);
   
@@ -420,8 +557,10 @@ void cartesian_dda::dda_step()
 //			Serial.print("Steps Made ");
 //			Serial.println(stepsMade);
 			
+			if(laser_pwm)
+				analogWrite(SPINDLE_PWM_PIN, 0);
 			disable_steppers();
-			setTimer(DEFAULT_TICK);
+			timestep = DEFAULT_TICK;
 		}    
 	}
 }
@@ -430,6 +569,25 @@ void cartesian_dda::dda_step()
 // Run the DDA
 void cartesian_dda::dda_start()
 {    
+	if(outputs_on || outputs_off)
+		sharedMachineModel.setOutputs(outputs_on, outputs_off);
+	
+	if(kind == kSyncBlock)
+	{
+		sharedMachineModel.syncAction(sync_action, sync_value);
+		return;
+	}
+	
+	if(kind == kDwellBlock)
+	{
+		if(!nullmove)
+		{
+			timestep = min(dwell_left, MAX_DWELL_TICK);
+			live = true;
+		}
+		return;
+	}
+	
 	// Set up the DDA
 	if(!nullmove)
 	{
@@ -464,35 +622,51 @@ void cartesian_dda::dda_start()
 #endif
 		digitalWrite(Z_DIR_PIN, d);
 	
-		d = 1;
+		// A and B may be busy on the index channel, leave them alone unless we move them
+		if(delta_steps.a || (gear_steps && gear_slave == kGearA))
+		{
+			d = 1;
 #if INVERT_A_DIR == 1
-		if(a_direction)
-			d = 0;
+			if(a_direction)
+				d = 0;
 #else
-		if(!a_direction)
-			d = 0;	
+			if(!a_direction)
+				d = 0;	
 #endif
-	  digitalWrite(A_DIR_PIN, d);
+			digitalWrite(A_DIR_PIN, d);
+		}
 	  
-		d = 1;
+		if(delta_steps.b || (gear_steps && gear_slave == kGearB))
+		{
+			d = 1;
 #if INVERT_B_DIR == 1
-		if(b_direction)
-			d = 0;
+			if(b_direction)
+				d = 0;
 #else
-		if(!b_direction)
-			d = 0;	
+			if(!b_direction)
+				d = 0;	
 #endif
-		digitalWrite(B_DIR_PIN, d);
+			digitalWrite(B_DIR_PIN, d);
+		}
 	  
 		//turn on steppers to start moving =)
 		enable_steppers();
 	
-		setTimer(DEFAULT_TICK);
+		timestep = DEFAULT_TICK;
 		live = true;
 		feed_change = true; // force timer setting on the first call to dda_step()
 	}
 }
 
+void cartesian_dda::laser_power()
+{
+	spindle.laserHeld = false;
+	long power = laser_pwm;
+	if(target_steps.f > 0 && current_steps.f < target_steps.f)
+		power = power*current_steps.f/target_steps.f;
+	analogWrite(SPINDLE_PWM_PIN, power);
+}
+
 void cartesian_dda::enable_steppers()
 {
 #ifdef X_ENABLE_PIN 
@@ -508,11 +682,11 @@ void cartesian_dda::enable_steppers()
     digitalWrite(Z_ENABLE_PIN, ENABLE_ON);
 #endif
 #ifdef A_ENABLE_PIN
-  if(delta_steps.a)
+  if(delta_steps.a || (gear_steps && gear_slave == kGearA))
     digitalWrite(A_ENABLE_PIN, ENABLE_ON);
 #endif  
 #ifdef B_ENABLE_PIN
-  if(delta_steps.b)
+  if(delta_steps.b || (gear_steps && gear_slave == kGearB))
     digitalWrite(B_ENABLE_PIN, ENABLE_ON);
 #endif  
 }
@@ -532,10 +706,12 @@ void cartesian_dda::disable_steppers()
 	digitalWrite(Z_ENABLE_PIN, !ENABLE_ON);
 #endif
 #if DISABLE_A
-	digitalWrite(A_ENABLE_PIN, !ENABLE_ON);
+	if(!sharedMachineModel.indexBusy())
+		digitalWrite(A_ENABLE_PIN, !ENABLE_ON);
 #endif
 #if DISABLE_B
-	digitalWrite(B_ENABLE_PIN, !ENABLE_ON);
+	if(!sharedMachineModel.indexBusy())
+		digitalWrite(B_ENABLE_PIN, !ENABLE_ON);
 #endif        
 }
 
@@ -543,6 +719,7 @@ void cartesian_dda::shutdown()
 {
   live = false;
   nullmove = false;
+  timestep = DEFAULT_TICK;
   target_steps = current_steps;
   disable_steppers();
 }
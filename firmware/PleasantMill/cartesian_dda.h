@@ -35,12 +35,30 @@
 
 // Main class for moving the RepRap machine about
 
+// What a queue entry does
+enum {
+	kMoveBlock,		// A move (set_target())
+	kDwellBlock,	// Wait a fixed time (set_dwell())
+	kSyncBlock		// Do something at exactly this point in the queue (set_sync(), see MachineModel::syncAction())
+};
+
 class cartesian_dda
 {
 private:
+  byte kind;                   // kMoveBlock, kDwellBlock or kSyncBlock
+  long dwell_left;             // kDwellBlock: microseconds left
+  byte sync_action;            // kSyncBlock: the action to take
+  byte sync_value;             // and its argument
+  long line_nr;                // Line number of the command which queued this block, -1 = none (telemetry)
+  byte outputs_on;             // Digital outputs switched when the block starts (M62/M63), bit 0 = P0
+  byte outputs_off;
+  byte laser_pwm;              // Laser mode (M907): the power at the programmed feed, 0 = dark
+  
   FloatPoint target_position;  // Where it's going
   FloatPoint delta_position;   // The difference between the two
   float distance;              // How long the path is
+  FloatPoint units;            // Units and zero offset this move was planned with (G20/G21, G54..G59, G92)
+  FloatPoint zero_offset;
   
   LongPoint current_steps;     // Similar information as above in steps rather than units
   LongPoint target_steps;
@@ -48,6 +66,14 @@ private:
   LongPoint dda_counter;       // DDA error-accumulation variables
   long t_scale;                // When doing lots of t steps, scale them so the DDA doesn't spend for ever on them
   
+  byte gear_master;            // Electronic gearing (M915): the slave makes gear_num/gear_den steps per master step
+  byte gear_slave;
+  long gear_num;
+  long gear_den;
+  long gear_acc;               // Gearing error-accumulation variable
+  long gear_steps;             // The number of steps the slave makes in this move
+  bool gear_direction;
+  
   volatile bool x_direction;            // Am I going in the + or - direction?
   volatile bool y_direction;
   volatile bool z_direction;
@@ -69,8 +95,9 @@ private:
   
   long slowSteps;
   long easeOutTrigger;
+  long easeOutPlanned;         // easeOutTrigger before a feed hold
   
-  long timestep;               // microseconds
+  long timestep;               // microseconds until the next call of dda_step()
   bool nullmove;               // this move is zero length
   volatile bool real_move;     // Flag to know if we've changed something physical
   volatile bool feed_change;   // Flag to know if feedrate has changed
@@ -86,6 +113,19 @@ private:
   void do_a_step();
   void do_b_step();
   
+  // Let the geared slave axis follow one step of its master
+  
+  void gear_follow(bool dir);
+  void gear_step();
+  
+  // Dwell and sync blocks: the position for stepPosition()
+  
+  void hold_position();
+  
+  // Laser mode: the power in proportion to the current over the programmed speed
+  
+  void laser_power();
+  
   // Can this axis step?
   
   bool xCanStep(long current, long target, bool dir);
@@ -115,7 +155,19 @@ public:
   
   // Set where I'm going
   
-  void set_target(const FloatPoint& p);
+  void set_target(const FloatPoint& p, bool rapid);
+  
+  // Or wait instead
+  
+  void set_dwell(unsigned long milliseconds);
+  
+  // Or do something when the moves before this one are done
+  
+  void set_sync(byte action, byte value);
+  
+  // Switch digital outputs when this block starts
+  
+  void set_outputs(byte on, byte off) { outputs_on = on; outputs_off = off; }
   
   // Start the DDA
   
@@ -129,6 +181,29 @@ public:
   
   bool active();
   
+  // The timer interval this DDA wants (see MachineModel::handleInterrupt())
+  
+  long stepInterval();
+  
+  // Feed hold: slow enough to stand still? And speed up again afterwards
+  
+  bool slowedDown();
+  void resume();
+  
+  // Convert absolute steps into the local coordinates of this move
+  
+  FloatPoint toLocal(const LongPoint& steps);
+  
+  // Does this move turn A or B?
+  
+  bool movesRotary();
+  
+  // For the telemetry (M905)
+  
+  long lineNr() { return line_nr; }
+  LongPoint stepPosition() { return current_steps; }
+  float feedrate() { return (kind == kMoveBlock && live) ? target_position.f : 0.; }
+  
   // Are we extruding at the moment?
   
   //bool extruding();
@@ -144,6 +219,39 @@ inline bool cartesian_dda::active()
   return live;
 }
 
+inline long cartesian_dda::stepInterval()
+{
+  return timestep;
+}
+
+inline bool cartesian_dda::slowedDown()
+{
+#if EASEINOUT
+  return !live || kind != kMoveBlock || current_steps.f <= slowSteps;
+#else
+  return true;
+#endif
+}
+
+inline void cartesian_dda::resume()
+{
+#if EASEINOUT
+  if(live && kind == kMoveBlock)
+    easeOutTrigger = easeOutPlanned;
+#endif
+}
+
+inline FloatPoint cartesian_dda::toLocal(const LongPoint& steps)
+{
+  FloatPoint local = from_steps(units, steps);
+  return local - zero_offset;
+}
+
+inline bool cartesian_dda::movesRotary()
+{
+  return kind == kMoveBlock && (delta_steps.a || delta_steps.b || gear_steps);
+}
+
 //inline bool cartesian_dda::extruding()
 //{
 //  return live && (current_steps.e != target_steps.e);
@@ -180,6 +288,48 @@ inline void cartesian_dda::do_b_step()
 	digitalWrite(B_STEP_PIN, LOW);
 }
 
+// The slave axis stays on target as far as the DDA is concerned
+
+inline void cartesian_dda::gear_step()
+{
+	if(gear_slave == kGearA)
+	{
+		do_a_step();
+		if(a_direction)
+			current_steps.a++;
+		else
+			current_steps.a--;
+		target_steps.a = current_steps.a;
+	}
+	else
+	{
+		do_b_step();
+		if(b_direction)
+			current_steps.b++;
+		else
+			current_steps.b--;
+		target_steps.b = current_steps.b;
+	}
+}
+
+inline void cartesian_dda::gear_follow(bool dir)
+{
+	if(dir)
+		gear_acc += gear_num;
+	else
+		gear_acc -= gear_num;
+	while(gear_acc >= gear_den)
+	{
+		gear_step();
+		gear_acc -= gear_den;
+	}
+	while(gear_acc <= -gear_den)
+	{
+		gear_step();
+		gear_acc += gear_den;
+	}
+}
+
 inline long cartesian_dda::calculate_feedrate_delay(const float& feedrate)
 {  
         
@@ -42,6 +42,7 @@
 #define X_ENDSTOP_INVERTING 1
 #define Y_ENDSTOP_INVERTING 1
 #define Z_ENDSTOP_INVERTING 1
+#define PROBE_INVERTING 1		// The probe (PROBE_PIN) pulls the pin low on contact
 
 #define MICROSTEPPING 8L
 #define X_STEPS_PER_MM   MICROSTEPPING*100L
@@ -50,6 +51,13 @@
 #define A_STEPS_PER_MM   MICROSTEPPING*100L
 #define B_STEPS_PER_MM   MICROSTEPPING*100L
 
+// Rotary axes are programmed in degrees and are not affected by G20/G21.
+// Set to 0 to drive A or B as a linear axis (using A_STEPS_PER_MM/B_STEPS_PER_MM)
+#define A_AXIS_ROTARY 1
+#define B_AXIS_ROTARY 1
+#define A_STEPS_PER_DEGREE (MICROSTEPPING*10L)	// 1.8 degree motor on a 1:18 worm gear
+#define B_STEPS_PER_DEGREE (MICROSTEPPING*10L)
+
 #define INVERT_X_DIR 1
 #define INVERT_Y_DIR 1
 #define INVERT_Z_DIR 0
@@ -58,6 +66,7 @@
 
 #define FAST_XY_FEEDRATE 1100.0
 #define FAST_Z_FEEDRATE  1100.0
+#define INDEX_FEEDRATE   1800.0	// Degrees per minute for M910 index moves without F
 
 #define ACCELERATION  ACCELERATION_OFF
 #define EASEINOUT 1
@@ -110,6 +119,9 @@
 // The speed at which to talk with the host computer; default is 19200=
 #define HOST_BAUD 115200 // *RO
 
+// How long the host has to confirm a new baud rate (M906) at that rate, in ms
+#define BAUD_CONFIRM_TIMEOUT 3000 // *RO
+
 // The number of mm below which distances are insignificant (one tenth the
 // resolution of the machine is the default value).
 #define SMALL_DISTANCE 0.01 // *RO
@@ -120,12 +132,48 @@
 //our command string length
 #define COMMAND_SIZE 128 // *RO
 
+// The number of received commands which can wait for their execution
+#define COMMAND_QUEUE_SIZE 4 // *RO
+
 // Our response string length
 #define RESPONSE_SIZE 256 // *RO
 
 // The size of the movement buffer
 #define BUFFER_SIZE 4 // *RO
 
+// The number of Z-only (or A/B-only) moves, dwells and output switches cutter radius
+// compensation can hold back while it waits for the next XY move to calculate a corner
+#define COMP_LOOKAHEAD 8 // *RO
+
+// The size of the movement buffer of the A/B index channel (M910)
+#define INDEX_BUFFER_SIZE 4 // *RO
+
+// Numbered parameters #1..#(NUM_PARAMETERS-1), #0 is always 0
+#define NUM_PARAMETERS 64 // *RO
+
+// RAM for subroutines (O-words) and loops, and how deep they may be nested
+#define PROGRAM_SIZE 1024 // *RO
+#define MAX_SUBROUTINES 8 // *RO
+#define MAX_NESTING 8 // *RO
+
+// Spindle speed at full PWM, and how long it takes to get from 0 to that speed
+// and back, in ms. Starts, stops and reversals wait in proportion.
+#define SPINDLE_MAX_RPM 10000.
+#define SPINDLE_SPINUP_TIME 3000
+#define SPINDLE_SPINDOWN_TIME 3000
+
+// Probed height map (G29, M420): at most MESH_MAX_POINTS_X by MESH_MAX_POINTS_Y points.
+// Moves are cut into MESH_SEGMENTS_PER_CELL pieces per grid cell, so Z follows the surface.
+#define MESH_MAX_POINTS_X 7 // *RO
+#define MESH_MAX_POINTS_Y 7 // *RO
+#define MESH_SEGMENTS_PER_CELL 4
+#define PROBE_FEEDRATE 50.		// mm/min, G29 without F
+#define PROBE_TRAVEL_FEEDRATE 300.	// mm/min, between the probes of M931..M933 (stops on contact)
+
+// Jobs on an SD card (M20..M30, see Storage.h). The card needs the SPI pins 50..53,
+// which the X and Y max endstops use on this board (see pins.h).
+//#define STORAGE_SD
+
 // Number of microseconds between timer interrupts when no movement
 // is happening
 #define DEFAULT_TICK (long)1000 // *RO
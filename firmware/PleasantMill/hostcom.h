@@ -27,11 +27,14 @@
 #define HOSTCOM_H
 
 #include "MachineModel.h"
+#include "HostSerial.h"
+#include "Storage.h"
+#include "Persistent.h"
 
 /*
   Class to handle sending messages from and back to the host.
-  NOWHERE ELSE in this program should anything send to Serial.print()
-  or get anything from Serial.read().
+  NOWHERE ELSE in this program should anything send to or get anything
+  from the host port (see HostSerial.h).
   
   All communication is in printable ASCII characters.  Messages sent back
   to the host computer are terminated by a newline and look like this:
@@ -44,7 +47,9 @@
   rs
   !!
   
-  ok means that no error has been detected.
+  ok means that no error has been detected.  It is sent as soon as a command has been
+       received and checked, and the command has been queued for execution.  Errors
+       found when the command is executed later are reported as // lines.
   rs means resend, and must be followed by the line number to resend.
   !! means that a hardware fault has been detected.  The RepRap machine will
        shut down immediately after it has sent this message.
@@ -68,6 +73,26 @@
   
   once to the host before sending anything else.  This should not be replaced or augmented
   by version numbers and the like.  M115 requests those.
+  
+  Character counting: The received characters are buffered (see HostSerial.h). The host
+  doesn't need to wait for the ok of each line; it may send on as long as the characters
+  of all lines without an ok yet fit into the buffer. The size is sent with the boot
+  message (RX:) and with M115 (X-RX_BUFFER_SIZE:).
+  
+  Acknowledge modes (M904): By default each line is answered with ok as described above.
+  S1 adds the number of the line (if it has one): "ok 123".  S2 acknowledges numbered
+  lines cumulatively: "ok 123" means that all lines up to 123 have been accepted.  The
+  acks are held back while more lines are coming in (up to MAX_CUMULATIVE_ACKS).  Lines
+  without a number, errors and answers with data are still answered one by one.
+  
+  Baud rate (M906): "M906 S250000" is answered with ok at the old rate, then the
+  machine switches. The host switches, too, and confirms with "M906" (without S) at the
+  new rate within BAUD_CONFIRM_TIMEOUT ms, which stores the rate in the EEPROM. Without
+  the confirmation the machine goes back to the old rate and says so in a // line.
+  
+  Real-time commands are single characters outside of any line (see HostSerial.h):
+  ? status (answered with a "// Status:" line), ! feed hold, ~ resume and
+  Ctrl-X soft reset (answered with the boot message, all queued commands are lost).
      
 
   A line ending with a single "\" character immediately before the newline is considered 
@@ -75,6 +100,20 @@
   
  */
 
+// What to report to the host (SendDebug, see M111)
+#define DEBUG_ECHO (1<<0)
+#define DEBUG_INFO (1<<1)
+#define DEBUG_ERRORS (1<<2)
+
+// Acknowledge modes (M904)
+enum {
+  kAckEach,
+  kAckNumbered,
+  kAckCumulative
+};
+
+#define MAX_CUMULATIVE_ACKS 8
+
 // Can't get lower than absolute zero...
 
 #define NO_TEMP -300
@@ -89,9 +128,15 @@ public:
   void setCoords(const FloatPoint& where);
   void capabilities();
   void setResend(long ln);
+  bool errorPending();
+  void setAckMode(byte mode);
+  void setAckLine(long ln);
+  void flushAck();
   void setFatal();
   void sendMessage(bool doMessage);
-  void informational(char* message);
+  void sendDeferred(bool doMessage);
+  void informational(const char* message);
+  void sendStatus();
   void start();
   
 // Wrappers for the comms interface
@@ -103,10 +148,14 @@ public:
   void put(const int i);
   void put(double i);  //overloading!
   void put(); // to allow putting an undefined constant as "n/a"
+  void putFixed(long value, byte decimals);
+  void putRaw(char c);
   void putEnd();
   void putWs();
   byte gotData();
   char get();
+  bool lostData();
+  void flushInput();
   
 private:
   void reset();
@@ -120,6 +169,10 @@ private:
   float a;
   float b;
   long resend;
+  byte ackMode;
+  long ackLine;       // Number of the line answered by the next ok, -1 = none
+  long pendingAck;    // Cumulative mode: the last line accepted, but not acknowledged yet
+  byte pendingCount;
   bool fatal;
   bool sendCoordinates;  
   bool sendCapabilities;
@@ -128,21 +181,50 @@ private:
 inline hostcom::hostcom()
 {
   fatal = false;
+  ackMode = kAckEach;
+  ackLine = -1;
+  pendingCount = 0;
   reset();
 }
 
 // Wrappers for the comms interface
-inline void hostcom::putInit() {  Serial.begin(HOST_BAUD); }
-inline void hostcom::put(const char* s) { Serial.print(s); }
-inline void hostcom::put(const float& f) { Serial.print(f); }
-inline void hostcom::put(const long& l) { Serial.print(l); }
-inline void hostcom::put(const int i) { Serial.print(i); }
-inline void hostcom::put(double i) { Serial.print(i); }
-inline void hostcom::put() { Serial.print("n/a"); }
-inline void hostcom::putEnd() { Serial.println(); }
-inline void hostcom::putWs() { Serial.println(" \\"); }
-inline byte hostcom::gotData() { return Serial.available(); }
-inline char hostcom::get() { return Serial.read(); }
+inline void hostcom::putInit() {  hostSerial.begin(EEPROM_ReadHostBaud()); }
+inline void hostcom::put(const char* s) { hostSerial.print(s); }
+inline void hostcom::put(const float& f) { putFixed(round(f*100.), 2); }
+inline void hostcom::put(const long& l) { putFixed(l, 0); }
+inline void hostcom::put(const int i) { putFixed(i, 0); }
+inline void hostcom::put(double i) { putFixed(round(i*100.), 2); }
+inline void hostcom::putRaw(char c) { hostSerial.write(c); }
+inline void hostcom::put() { hostSerial.print("n/a"); }
+// value is in units of 10^-decimals. Numbers are written without the float printer or sprintf.
+inline void hostcom::putFixed(long value, byte decimals)
+{
+  char b[14];
+  char* p = b+sizeof(b);
+  *--p = 0;
+  unsigned long u = (value < 0) ? -value : value;
+  for(byte i=0; i<decimals; i++)
+  {
+    *--p = '0' + u%10;
+    u /= 10;
+  }
+  if(decimals)
+    *--p = '.';
+  do
+  {
+    *--p = '0' + u%10;
+    u /= 10;
+  } while(u);
+  if(value < 0)
+    *--p = '-';
+  hostSerial.print(p);
+}
+inline void hostcom::putEnd() { hostSerial.print("\r\n"); }
+inline void hostcom::putWs() { hostSerial.print(" \\\r\n"); }
+inline byte hostcom::gotData() { return hostSerial.available(); }
+inline char hostcom::get() { return hostSerial.read(); }
+inline bool hostcom::lostData() { return hostSerial.overflowed(); }
+inline void hostcom::flushInput() { hostSerial.flush(); }
 
 // called after each message has been sent
 
@@ -164,19 +246,44 @@ inline void hostcom::start()
   putInit();
   put("PleasantMill[");
   put(FW_VERSION);
-  put("]");
+  put("] RX:");
+  put(hostSerial.rxBufferSize());
   putEnd();  
 }
 
 // sent info to the host verbatum, and immediately, try to avoid using this very much
-inline void hostcom::informational(char * message)
+inline void hostcom::informational(const char* message)
 {
-  putInit();
   put("// ");
   put(message);
   putEnd();  
 }
 
+// Answer to the real-time status request, as an informational line:
+// // Status: <Idle|Run|Hold> C: X:.. Y:.. Z:.. A:.. B:..
+inline void hostcom::sendStatus()
+{
+  FloatPoint p = sharedMachineModel.livePosition();
+  put("// Status: ");
+  if(sharedMachineModel.feedHold)
+    put("Hold");
+  else if(sharedMachineModel.qEmpty() && !sharedMachineModel.indexBusy())
+    put("Idle");
+  else
+    put("Run");
+  put(" C: X:");
+  put(p.x);
+  put(" Y:");
+  put(p.y);
+  put(" Z:");
+  put(p.z);
+  put(" A:");
+  put(p.a);
+  put(" B:");
+  put(p.b);
+  putEnd();
+}
+
 // Return the place to write messages into.  Typically this is used in lines like:
 // sprintf(talkToHost.string(), "Echo: %s", cmdbuffer);
 
@@ -224,6 +331,36 @@ inline void hostcom::setResend(long ln)
   resend = ln;
 }
 
+// Has the line just processed failed?
+
+inline bool hostcom::errorPending()
+{
+  return resend >= 0;
+}
+
+inline void hostcom::setAckMode(byte mode)
+{
+  flushAck();
+  ackMode = mode;
+}
+
+inline void hostcom::setAckLine(long ln)
+{
+  ackLine = ln;
+}
+
+// Send the cumulative ack held back so far
+
+inline void hostcom::flushAck()
+{
+  if(!pendingCount)
+    return;
+  put("ok ");
+  put(pendingAck);
+  putEnd();
+  pendingCount = 0;
+}
+
 // Flag that a fatal error has occurred (such as a temperature sensor failure).
 
 inline void hostcom::setFatal()
@@ -252,12 +389,35 @@ inline void hostcom::sendMessage(bool doMessage)
     put("!!");
     sendtext(true);
     putEnd();
+    hostSerial.drain();
     sharedMachineModel.shutdown();
     return; // Technically redundant - shutdown never returns.
   }
   
+  bool plainOk = (resend < 0 && etemp <= NO_TEMP && btemp <= NO_TEMP && !sendCoordinates && 
+  					!sendCapabilities && !(doMessage && message[0]));
+  if(ackMode == kAckCumulative && plainOk && ackLine >= 0)
+  {
+    pendingAck = ackLine;
+    ackLine = -1;
+    if(++pendingCount >= MAX_CUMULATIVE_ACKS)
+      flushAck();
+    reset();
+    return;
+  }
+  
+  // The lines before have to be acknowledged first
+  flushAck();
+  
   if(resend < 0)
+  {
     put("ok");
+    if(ackMode != kAckEach && ackLine >= 0)
+    {
+      put(" ");
+      put(ackLine);
+    }
+  }
   else
   {
     put("rs ");
@@ -299,6 +459,8 @@ inline void hostcom::sendMessage(bool doMessage)
     
     // agreed avlues:
    putWs();
+   put("X-RX_BUFFER_SIZE:"); put(hostSerial.rxBufferSize()); putWs();
+   put("X-STORAGE:"); put(STORAGE_AVAILABLE); putWs();
 //   put("PROTOCOL_VERSION:"); put(PROTOCOL_VERSION); putWs();
 //   put("FIRMWARE_NAME:"); put(FIRMWARE_NAME); putWs();
 //   put("FIRMWARE_VERSION:"); put(FIRMWARE_VERSION); putWs();
@@ -355,9 +517,33 @@ inline void hostcom::sendMessage(bool doMessage)
   
   putEnd();
   
+  ackLine = -1;
   reset(); 
 }
 
+// Report the outcome of a command whose ok has already been sent. Only errors and
+// messages are reported, as informational lines.
+
+inline void hostcom::sendDeferred(bool doMessage)
+{
+  if(fatal)
+  {
+    sendMessage(true);
+    return;
+  }
+  
+  if(resend >= 0 || (doMessage && message[0]))
+  {
+    put("//");
+    if(resend >= 0)
+      put(" Error:");
+    sendtext(true);
+    putEnd();
+  }
+  
+  reset();
+}
+
 extern hostcom talkToHost;
 
 #endif
@@ -68,6 +68,24 @@
 #define EXTRUDER_1_TEMPERATURE_PIN (byte)2 
 
 
+// Digital outputs switched with the moves (M62/M63), P0 first
+#define DIGITAL_OUTPUT_COUNT 4
+#define DIGITAL_OUTPUT_PINS { (byte)28, (byte)29, (byte)31, (byte)32 }
+
+// Spindle (M3/M4/M5, S)
+#define SPINDLE_ENABLE_PIN (byte)38
+#define SPINDLE_DIR_PIN (byte)39		// High for M4
+#define SPINDLE_PWM_PIN (byte)9			// Timer 2, the step timer has timer 1
+#define SPINDLE_ENABLE_ON 1
+
+// SD card chip select (STORAGE_SD, the card shares the SPI bus with X_MAX_PIN and Y_MAX_PIN)
+#define SD_CS_PIN (byte)49
+
+// Probe for G29 and G38.x, e.g. a touch plate or the PCB's copper against the grounded tool.
+// It needs an external interrupt, which latches the position (see MachineModel::probeLatch()).
+#define PROBE_PIN (byte)3
+#define PROBE_INTERRUPT 1		// attachInterrupt() number of PROBE_PIN (INT5)
+
 // UI Pins
 #define JOYSTICK_P (byte)25
 #define JOYSTICK_A (byte)23
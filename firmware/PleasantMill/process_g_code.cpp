@@ -35,6 +35,13 @@
 #include "cartesian_dda.h"
 #include "hostcom.h"
 #include "Persistent.h"
+#include "CutterCompensation.h"
+#include "BinaryProtocol.h"
+#include "Expression.h"
+#include "ProgramControl.h"
+#include "Storage.h"
+#include "Spindle.h"
+#include "HeightMap.h"
 
 #define MIN(x, y) (x<y)?x:y
 
@@ -60,34 +67,42 @@ enum
 	GCODE_A,
 	GCODE_B,
 	GCODE_L,
+	GCODE_D,
 	GCODE_COUNT
 };
 
-#define PARSE_INT(ch, str, len, val, seen, flag) \
+#define PARSE_INT(ch, val, flag) \
 	case ch: \
-		len = scan_int(str, &val, seen, flag); \
+		val = whole; \
+		cmd.seen[flag] = true; \
 		break;
 
-#define PARSE_LONG(ch, str, len, val, seen, flag) \
+#define PARSE_FLOAT(ch, val, flag) \
 	case ch: \
-		len = scan_long(str, &val, seen, flag); \
-		break;
-
-#define PARSE_FLOAT(ch, str, len, val, seen, flag) \
-	case ch: \
-		len = scan_float(str, &val, seen, flag); \
+		val = value; \
+		cmd.seen[flag] = true; \
 		break;
 
+void queueMove(const FloatPoint& p, bool rapid = false);
 void rapidMove(FloatPoint targetPoint);
 void drawArc(float centerX, float centerY, float endpointX, float endpointY, boolean clockwise);
 void doDrillCycle(int gCode, FloatPoint &fp);
+bool pumpDrillCycle();
+void probeHeightMap();
+void straightProbe(int gSub, const FloatPoint& target);
+void probingCycle(int mCode);
+void reportHeightMap();
 
 void process_string(char instruction[], int size);
-int scan_int(char *str, int *valp, bool seen[], unsigned int flag);
-int scan_float(char *str, float *valp, bool seen[], unsigned int flag);
-int scan_long(char *str, long *valp, bool seen[], unsigned int flag);
+void execute_queued_command();
+void run_program_line();
+void finish_queued_commands();
+char read_char(char ch);
+void finish_line();
+void pauseJob(long position);
 
 #define kMaxGCommands 5
+#define STRING_BUFFER_SIZE 32
 
 /* gcode line parse results */
 struct GcodeParser
@@ -96,6 +111,7 @@ struct GcodeParser
         
     short GIndex;
     int G[kMaxGCommands];
+    int GSub[kMaxGCommands];	// Sub-code after the decimal point, e.g. 1 for G7.1
     int M;
     int T;
     float P;
@@ -111,13 +127,14 @@ struct GcodeParser
     float R;
     float Q;
     int L;
+    int D;
     int Checksum;
     long N;
-    long LastLineNrRecieved;
+    long LastLineNrRecieved;	// When this command was received
+    long JobPos;				// Where the line starts in the job file, -1 = from the host
+    char strArg[STRING_BUFFER_SIZE];	// The string argument ("...")
 };
 
-#define STRING_BUFFER_SIZE 32
-
 //our command string
 char cmdbuffer[COMMAND_SIZE];
 char c = '?';
@@ -128,11 +145,75 @@ boolean stringArg = false;
 char strArgBuffer[STRING_BUFFER_SIZE];
 char strBuffer[STRING_BUFFER_SIZE];
 
+// The words of a line are parsed as the characters come in. Numbers are collected
+// as an integer mantissa and a number of decimals, no strtod() needed.
+#define MAX_DECIMALS 6
+const long kPow10[MAX_DECIMALS+1] = { 1L, 10L, 100L, 1000L, 10000L, 100000L, 1000000L };
+const float kInvPow10[MAX_DECIMALS+1] = { 1., .1, .01, .001, .0001, .00001, .000001 };
+
+char wordLetter = 0;		// The word being read, 0 = none
+long wordMantissa;
+byte wordDecimals;
+byte wordScale;				// Integer digits which didn't fit into the mantissa
+bool wordNegative;
+bool wordDigits;			// Seen any digits yet?
+bool wordPoint;				// Seen the decimal point?
+byte lineChecksum;			// XOR of the characters before the '*'
+bool checksumComplete;
+bool needsEvaluation;		// Parameters, expressions or O-words: the line is parsed again as a whole (evaluate_line())
+byte bracketDepth;			// Inside an [expression], a * is a multiplication and not the checksum
+OWord oWord;				// The O-word found by evaluate_line()
+long programJobPos = -1;	// The job line which started the running subroutine or loop, -1 = sent by the host
+
 FloatPoint fp;
+CutterCompensation cutterComp;
+
+// Jobs run from storage (M23/M24) and uploads into storage (M28/M29)
+enum {
+	kJobNone,
+	kJobSelected,		// M23
+	kJobRunning,		// M24: its lines are read while the host sends nothing
+	kJobPaused			// M25
+};
+byte jobState = kJobNone;
+char jobName[STORAGE_NAME_SIZE];
+bool uploading = false;			// The host's lines go into the file until M29
+bool readingJob = false;		// The line being read comes from storage
+long jobLineStart;				// Where it starts in the file
+#define kJobLineDropped -2		// GcodeParser::JobPos of a line read ahead of a failed one (pauseJob())
+bool hostLineStarted = false;	// Part of a host line has been read already
+
+// Canned drill cycles are expanded lazily: doDrillCycle() checks the parameters and sets
+// up the cycle, pumpDrillCycle() queues its moves whenever there's room in the queue.
+enum {
+	kDrillIdle,
+	kDrillStart,		// Up to the R level if below
+	kDrillPosition,		// Rapid to the hole
+	kDrillToR,			// Rapid down to the R level
+	kDrillFeed,			// Drill (the next peck)
+	kDrillPeckRetract,
+	kDrillPeckReturn,
+	kDrillDwell,
+	kDrillRetract
+};
+
+struct DrillCycle
+{
+	byte phase;
+	FloatPoint p;			// The current target
+	float bottom;			// Z of the bottom of the holes
+	float z;				// Depth reached so far
+	float delta;			// Peck depth, 0 = in one go
+	float oldZ;				// For G98
+	unsigned int dwell;
+	int loops;
+	bool slowRetract;
+	bool fullRetract;
+	float stepX;			// Incremental mode: distance to the next hole
+	float stepY;
+};
 
-#define DEBUG_ECHO (1<<0)
-#define DEBUG_INFO (1<<1)
-#define DEBUG_ERRORS (1<<2)
+DrillCycle drill;
 
 byte SendDebug =  DEBUG_INFO | DEBUG_ERRORS | DEBUG_ECHO;
 
@@ -143,7 +224,24 @@ int last_gcode_g = -1;
 
 float extruder_speed = 0;
 
-GcodeParser gc;	/* string parse result */
+GcodeParser gc;	/* the command being executed */
+
+// Commands are parsed and checked as they come in, and wait here for their execution. This way
+// the serial line is read on while a command waits for room in the motion queue.
+GcodeParser commandQueue[COMMAND_QUEUE_SIZE];
+byte commandHead = 0;	// Next free slot
+byte commandTail = 0;	// Next command to execute
+long lastLineNrRecieved;
+
+inline bool commandQueueEmpty()
+{
+	return commandHead == commandTail;
+}
+
+inline bool commandQueueFull()
+{
+	return (byte)((commandHead+1)%COMMAND_QUEUE_SIZE) == commandTail;
+}
 
 inline bool seenAnything()
 {
@@ -153,6 +251,15 @@ inline bool seenAnything()
 	return false;
 }
 
+// A line with nothing but S (and its line number) only sets the spindle speed
+inline bool onlySpindleSpeed()
+{
+	for(int i=0; i<GCODE_COUNT;i++)
+		if(gc.seen[i] && i!=GCODE_S && i!=GCODE_N && i!=GCODE_CHECKSUM)
+			return false;
+	return gc.seen[GCODE_S];
+}
+
 //init our string processing
 inline void init_process_string()
 {
@@ -162,64 +269,400 @@ inline void init_process_string()
   strArgCount = 0;
   strArgBuffer[0]=0x0;
   
-  gc.GIndex=0;
+  // The next line is parsed into the free slot of the command queue
+  GcodeParser& cmd = commandQueue[commandHead];
+  for(int i=0; i<GCODE_COUNT;i++)
+    cmd.seen[i] = false;
+  cmd.GIndex = 0;
+  wordLetter = 0;
+  lineChecksum = 0;
+  checksumComplete = false;
+  needsEvaluation = false;
+  oWord.keyword = kONone;	// Set again by evaluate_line() only
+  bracketDepth = 0;
 }
 
-// Get a command and process it
-void get_and_do_command()
-{    
-	c = ' ';
-	while(talkToHost.gotData() && c != '\n')
+// Store a word. whole is the integer part of value, sub the first decimal.
+void store_word(GcodeParser& cmd, char letter, long whole, int sub, float value)
+{
+		switch(letter)
+		{
+			case 'G':
+					if(cmd.GIndex<kMaxGCommands)
+					{
+						cmd.G[cmd.GIndex] = whole;
+						// Sub-code after the decimal point, e.g. 1 for G7.1
+						cmd.GSub[cmd.GIndex] = sub;
+						cmd.GIndex++;
+						cmd.seen[GCODE_G] = true;
+					}
+					else
+					{
+						sprintf(talkToHost.string(), "Too many G codes per line");
+						talkToHost.setFatal();
+						talkToHost.sendMessage(true);
+					}
+					break;
+			PARSE_INT('M', cmd.M, GCODE_M);
+			PARSE_INT('T', cmd.T, GCODE_T);
+			PARSE_INT('L', cmd.L, GCODE_L);
+			PARSE_INT('D', cmd.D, GCODE_D);
+			PARSE_FLOAT('S', cmd.S, GCODE_S);
+			PARSE_FLOAT('P', cmd.P, GCODE_P);
+			PARSE_FLOAT('X', cmd.X, GCODE_X);
+			PARSE_FLOAT('Y', cmd.Y, GCODE_Y);
+			PARSE_FLOAT('Z', cmd.Z, GCODE_Z);
+			PARSE_FLOAT('I', cmd.I, GCODE_I);
+			PARSE_FLOAT('J', cmd.J, GCODE_J);
+			PARSE_FLOAT('F', cmd.F, GCODE_F);
+			PARSE_FLOAT('R', cmd.R, GCODE_R);
+			PARSE_FLOAT('Q', cmd.Q, GCODE_Q);
+			PARSE_FLOAT('E', cmd.A, GCODE_E);
+			PARSE_FLOAT('A', cmd.A, GCODE_A);
+			PARSE_FLOAT('B', cmd.B, GCODE_B);
+			PARSE_INT('N', cmd.N, GCODE_N);
+			PARSE_INT('*', cmd.Checksum, GCODE_CHECKSUM);
+			default:
+				break;
+		}
+}
+
+// Store the word which has just ended
+void finish_word()
+{
+	if(wordLetter && wordDigits)
 	{
-		c = talkToHost.get();
-		sharedMachineModel.blink();
-		if(c == '\r')
-			c = '\n';
-		// Throw away control chars except \n
-		if(c >= ' ' || c == '\n')
+		long mantissa = wordNegative ? -wordMantissa : wordMantissa;
+		long integer = mantissa/kPow10[wordDecimals];
+		float value = (float)mantissa * kInvPow10[wordDecimals];
+		if(wordScale)
 		{
+			for(byte i=0; i<wordScale; i++)
+				value *= 10.;
+			integer = (long)constrain(value, -2147483647., 2147483647.);
+		}
+		store_word(commandQueue[commandHead], wordLetter, integer,
+					wordDecimals ? (wordMantissa/kPow10[wordDecimals-1])%10 : 0, value);
+	}
+	wordLetter = 0;
+}
 
-		  //newlines are ends of commands.
-		  if (c != '\n')
-		  {
-			// Start of comment - ignore any bytes received from now on
-			if (c == ';' || c=='(')
-				comment = true;
-			
-			if(!comment)
+// True if the line reads a parameter, not only sets one (#n=). Their values, the probe
+// results (#5061..#5070) in particular, are those after the queued commands.
+bool reads_parameters(const char* line)
+{
+	for(const char* p = strchr(line, '#'); p; p = strchr(p, '#'))
+	{
+		p++;
+		while(*p == ' ' || (*p >= '0' && *p <= '9'))
+			p++;
+		if(*p != '=')
+			return true;
+	}
+	return false;
+}
+
+// Parse a line with parameters, expressions or an O-word. Parameters are set right away.
+bool evaluate_line(GcodeParser& cmd, const char* line)
+{
+	for(int i=0; i<GCODE_COUNT;i++)
+		cmd.seen[i] = false;
+	cmd.GIndex = 0;
+	oWord.keyword = kONone;
+	
+	const char* p = line;
+	while(*p)
+	{
+		char letter = *p;
+		if(letter == ' ')
+		{
+			p++;
+			continue;
+		}
+		if(letter == '#')	// #n=value
+		{
+			p++;
+			float n, value;
+			if(!readValue(p, n))
+				return false;
+			while(*p == ' ')
+				p++;
+			if(*p != '=')
 			{
-				if(c == '\"')
-				{
-					stringArg=!stringArg;
-					strArgBuffer[strArgCount]=0x0;
-				}
-				else if(stringArg)
+				expressionError = "= expected";
+				return false;
+			}
+			p++;
+			if(!readValue(p, value) || !setParameter(round(n), value))
+				return false;
+			continue;
+		}
+		if(letter == 'O')
+		{
+			p++;
+			oWord.number = atoi(p);
+			while(*p >= '0' && *p <= '9')
+				p++;
+			oWord.keyword = readOKeyword(p);
+			if(oWord.keyword == kONone)
+			{
+				expressionError = "unknown O-word";
+				return false;
+			}
+			oWord.argCount = 0;
+			for(;;)
+			{
+				while(*p == ' ')
+					p++;
+				if(*p != '[' || oWord.argCount >= MAX_CALL_ARGS)
+					break;
+				if(!readValue(p, oWord.args[oWord.argCount++]))
+					return false;
+			}
+			if(*p == '*')	// The checksum has been checked already
+				return true;
+			if(*p)
+			{
+				expressionError = "unexpected characters after the O-word";
+				return false;
+			}
+			return true;
+		}
+		if((letter >= 'A' && letter <= 'Z') || letter == '*')
+		{
+			p++;
+			float value;
+			if(!readValue(p, value))
+				return false;
+			store_word(cmd, letter, (long)value, ((long)round(fabs(value)*10.))%10, value);
+			continue;
+		}
+		expressionError = "unexpected character";
+		return false;
+	}
+	return true;
+}
+
+// Feed one (upper case) character of the line into the parser
+void parse_char(char ch)
+{
+	if(ch == '#' || ch == '[' || ch == 'O')
+		needsEvaluation = true;
+	if(ch == '[')
+		bracketDepth++;
+	else if(ch == ']' && bracketDepth > 0)
+		bracketDepth--;
+	
+	if(wordLetter)
+	{
+		if(ch>='0' && ch<='9')
+		{
+			if(wordMantissa >= 100000000L)	// Beyond float precision anyway, see readNumber()
+			{
+				if(!wordPoint)
+					wordScale++;
+			}
+			else if(wordPoint)
+			{
+				if(wordDecimals<MAX_DECIMALS)	// Ignore any further decimals
 				{
-					if(strArgCount<STRING_BUFFER_SIZE)
-						strArgBuffer[strArgCount++] = c;
+					wordMantissa = wordMantissa*10 + (ch-'0');
+					wordDecimals++;
 				}
-				else // If we're not in comment mode (and string mode), add it to our array.
-					cmdbuffer[serial_count++] = toupper(c);
 			}
-		  }
+			else
+				wordMantissa = wordMantissa*10 + (ch-'0');
+			wordDigits = true;
+			return;
+		}
+		if(ch=='.' && !wordPoint)
+		{
+			wordPoint = true;
+			return;
+		}
+		if((ch=='-' || ch=='+') && !wordDigits && !wordPoint)
+		{
+			if(ch=='-')
+				wordNegative = !wordNegative;
+			return;
+		}
+		if(ch==' ' && !wordDigits && !wordPoint)	// "G 1", "X - 10"
+			return;
+		finish_word();
+	}
+	
+	// Words in expressions are left to evaluate_line()
+	if(bracketDepth == 0 && ((ch>='A' && ch<='Z') || ch=='*'))
+	{
+		wordLetter = ch;
+		wordMantissa = 0;
+		wordDecimals = 0;
+		wordScale = 0;
+		wordNegative = false;
+		wordDigits = false;
+		wordPoint = false;
+	}
+}
+
+// Ctrl-X from the host: MachineModel::manage() has already stopped the machine and
+// cleared the motion queues. Forget everything received so far, too. Modal states
+// (units, WCS, ...) are kept, the position is where the machine stopped.
+void softReset()
+{
+	talkToHost.flushInput();
+	commandTail = commandHead;
+	init_process_string();
+	drill.phase = kDrillIdle;
+	cutterComp.cancel();
+	binaryProtocol.end();
+	programControl.abort();
+	jobState = kJobNone;
+	uploading = false;
+	storage.close();
+	
+	// absolutePosition only follows X, Y and Z, A and B keep what was queued last
+	FloatPoint live = sharedMachineModel.livePosition();
+	sharedMachineModel.localPosition.x = live.x;
+	sharedMachineModel.localPosition.y = live.y;
+	sharedMachineModel.localPosition.z = live.z;
+	
+	sharedMachineModel.resetState = kResetNone;
+	talkToHost.start();
+}
+
+// Get a command and process it
+void get_and_do_command()
+{    
+	if(sharedMachineModel.resetState == kResetDone)
+		softReset();
+	
+	// Cumulative acks (M904 S2) are held back only while more lines are being read
+	if(!talkToHost.gotData() || commandQueueFull())
+		talkToHost.flushAck();
+	
+	// Binary frames instead of G-code lines (M903)
+	if(binaryProtocol.active())
+	{
+		binaryProtocol.receive();
+		return;
+	}
+	
+	// Execute the next command if there's room in the motion queue. It has to wait
+	// until a canned cycle is queued completely, though.
+	if(!pumpDrillCycle() && !commandQueueEmpty() && !sharedMachineModel.qFull())
+		execute_queued_command();
+
+	// The host sent more than fits into the receive buffer. The damaged line is caught
+	// by its checksum (if the host sends checksums, that is)
+	if(talkToHost.lostData() && (SendDebug & DEBUG_ERRORS))
+		talkToHost.informational("Serial Error: receive buffer overflow");
+
+	// Stop reading when there's no room for another command
+	if(commandQueueFull())
+		return;
+
+	// While a subroutine or loop runs, the host's lines wait in the receive buffer
+	if(programControl.running())
+	{
+		run_program_line();
+		return;
+	}
+
+	// The host comes first, so it can pause (M25) or query (M27) a running job
+	if(talkToHost.gotData() || hostLineStarted)
+	{
+		readingJob = false;
+		c = ' ';
+		while(talkToHost.gotData() && c != '\n')
+		{
+			c = read_char(talkToHost.get());
+			sharedMachineModel.blink();
+		}
+		hostLineStarted = (c != '\n');
+		if(c == '\n')
+			finish_line();
+	}
+	else if(jobState == kJobRunning)
+	{
+		readingJob = true;
+		jobLineStart = storage.position();
+		int ch = 0;
+		c = ' ';
+		while(c != '\n' && (ch = storage.read()) >= 0)
+			c = read_char(ch);
+		if(ch < 0)
+		{
+			// The last line may lack its newline
+			c = '\n';
+			finish_line();
+			if(jobState == kJobRunning)		// Not paused by an error in that line
+			{
+				jobState = kJobNone;
+				storage.close();
+				if(SendDebug & DEBUG_INFO)
+					talkToHost.informational("Job done");
+			}
 		}
+		else
+			finish_line();
+		readingJob = false;
+	}
+}
+
+// Feed a received character into the line being read. Returns it, with \r as \n.
+char read_char(char ch)
+{
+	if(ch == '\r')
+		ch = '\n';
+	if(ch == '*' && bracketDepth == 0)
+		checksumComplete = true;
+	else if(!checksumComplete && ch != '\n')
+		lineChecksum ^= ch;
+	// Throw away control chars except \n
+	if(ch >= ' ')
+	{
+		// Start of comment - ignore any bytes received from now on
+		if (ch == ';' || ch=='(')
+			comment = true;
 		
-		// Buffer overflow?
-		if(serial_count >= COMMAND_SIZE)
-			init_process_string();
+		if(!comment)
+		{
+			if(ch == '\"')
+			{
+				stringArg=!stringArg;
+				strArgBuffer[strArgCount]=0x0;
+			}
+			else if(stringArg)
+			{
+				if(strArgCount<STRING_BUFFER_SIZE-1)
+					strArgBuffer[strArgCount++] = ch;
+			}
+			else // If we're not in comment mode (and string mode), parse it and add it to our array (for the echo)
+			{
+				cmdbuffer[serial_count] = toupper(ch);
+				parse_char(cmdbuffer[serial_count++]);
+			}
+		}
 	}
+	
+	// Buffer overflow?
+	if(serial_count >= COMMAND_SIZE)
+		init_process_string();
+	return ch;
+}
 
+// A line has been read completely
+void finish_line()
+{
 	//if we've got a real command, do it
-	if ((comment || serial_count) && c == '\n')
+	if (comment || serial_count)
 	{
 		if(serial_count>0)
 		{
 			// Terminate string
 			cmdbuffer[serial_count] = 0;
+			finish_word();
 					
-			if(SendDebug & DEBUG_ECHO)
-				sprintf(talkToHost.string(), "Echo: %s", cmdbuffer);
-							
 			//process our command!
 			process_string(cmdbuffer, serial_count);
 		}
@@ -227,67 +670,24 @@ void get_and_do_command()
 		//clear command.
 		init_process_string();
 		
-		// Say we're ready for the next one
-		talkToHost.sendMessage(SendDebug & DEBUG_INFO);
-	}
-}
-
-
-
-void parse_string(char instruction[ ], int size)
-{
-	int ind;
-	int len;	/* length of parameter argument */
-
-	for(int i=0; i<GCODE_COUNT;i++)
-		gc.seen[i] = false;
-
-	len=0;
-	/* scan the string for commands and parameters, recording the arguments for each,
-	 * and setting the seen flag for each that is seen
-	 */
-	for (ind=0; ind<size; ind += (1+len))
-	{
-		len = 0;
-		switch (instruction[ind])
+		// Say we're ready for the next one. Lines from storage aren't acknowledged.
+		if(readingJob)
 		{
-			case 'G':
-					if(gc.GIndex<kMaxGCommands)
-						len = scan_int(&instruction[ind+1], &(gc.G[gc.GIndex++]), gc.seen, GCODE_G);
-					else
-					{
-						sprintf(talkToHost.string(), "Too many G codes per line");
-						talkToHost.setFatal();
-						talkToHost.sendMessage(true);
-					}
-					break;
-			PARSE_INT('M', &instruction[ind+1], len, gc.M, gc.seen, GCODE_M);
-			PARSE_INT('T', &instruction[ind+1], len, gc.T, gc.seen, GCODE_T);
-			PARSE_INT('L', &instruction[ind+1], len, gc.L, gc.seen, GCODE_L);
-			PARSE_FLOAT('S', &instruction[ind+1], len, gc.S, gc.seen, GCODE_S);
-			PARSE_FLOAT('P', &instruction[ind+1], len, gc.P, gc.seen, GCODE_P);
-			PARSE_FLOAT('X', &instruction[ind+1], len, gc.X, gc.seen, GCODE_X);
-			PARSE_FLOAT('Y', &instruction[ind+1], len, gc.Y, gc.seen, GCODE_Y);
-			PARSE_FLOAT('Z', &instruction[ind+1], len, gc.Z, gc.seen, GCODE_Z);
-			PARSE_FLOAT('I', &instruction[ind+1], len, gc.I, gc.seen, GCODE_I);
-			PARSE_FLOAT('J', &instruction[ind+1], len, gc.J, gc.seen, GCODE_J);
-			PARSE_FLOAT('F', &instruction[ind+1], len, gc.F, gc.seen, GCODE_F);
-			PARSE_FLOAT('R', &instruction[ind+1], len, gc.R, gc.seen, GCODE_R);
-			PARSE_FLOAT('Q', &instruction[ind+1], len, gc.Q, gc.seen, GCODE_Q);
-			PARSE_FLOAT('E', &instruction[ind+1], len, gc.A, gc.seen, GCODE_E);
-			PARSE_FLOAT('A', &instruction[ind+1], len, gc.A, gc.seen, GCODE_A);
-			PARSE_FLOAT('B', &instruction[ind+1], len, gc.B, gc.seen, GCODE_B);
-			PARSE_LONG('N', &instruction[ind+1], len, gc.N, gc.seen, GCODE_N);
-			PARSE_INT('*', &instruction[ind+1], len, gc.Checksum, gc.seen, GCODE_CHECKSUM);
-			default:
-				break;
+			bool failed = talkToHost.errorPending();
+			talkToHost.sendDeferred(SendDebug & DEBUG_INFO);
+			if(failed)
+				pauseJob(jobLineStart);
 		}
+		else
+			talkToHost.sendMessage(SendDebug & DEBUG_INFO);
 	}
 }
 
+
+
 void fetchCartesianParameters()
 {
-	fp = sharedMachineModel.localPosition;
+	fp = cutterComp.position();
 	if (sharedMachineModel.getAbsMode())
 	{
 		if (gc.seen[GCODE_X])
@@ -301,7 +701,7 @@ void fetchCartesianParameters()
 		if (gc.seen[GCODE_A])
 			fp.a = gc.A;
 		if (gc.seen[GCODE_B])
-			fp.a = gc.B;
+			fp.b = gc.B;
 	}
 	else
 	{
@@ -320,69 +720,235 @@ void fetchCartesianParameters()
 	}
 
 	// Get feedrate if supplied - feedrates are always absolute???
-	if ( gc.seen[GCODE_F] )
+	// In inverse time mode the feedrate is calculated per move, see inverseTimeFeedrate()
+	if ( gc.seen[GCODE_F] && !sharedMachineModel.getInverseTimeMode())
 		fp.f = MIN(gc.F, FAST_XY_FEEDRATE);
 }
 
-void execute_commands(char instruction[])
+// While cylindrical interpolation (G7.1) is active the A axis is driven by Y,
+// and commands which would change the relation between the two are refused
+bool cylindricalConflict(int gCode)
+{
+	if(sharedMachineModel.getCylinderRadius()>0. && (gCode>3 || gc.seen[GCODE_A]))
+	{
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "Dud G code: G%d not possible during cylindrical interpolation", gCode);
+		talkToHost.setResend(gc.LastLineNrRecieved+1);
+		return true;
+	}
+	return false;
+}
+
+// While electronic gearing (M915) is active, the slave axis can't be moved on its own
+bool gearConflict(int gCode)
+{
+	byte slave = sharedMachineModel.getGearSlave();
+	if(slave!=kGearNone && (gCode==28 || (slave==kGearA && gc.seen[GCODE_A]) || (slave==kGearB && gc.seen[GCODE_B])))
+	{
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "Dud G code: G%d not possible with electronic gearing (M916 first)", gCode);
+		talkToHost.setResend(gc.LastLineNrRecieved+1);
+		return true;
+	}
+	return false;
+}
+
+// Report an error of a storage M-code
+void storage_error(const char* problem)
+{
+	if(SendDebug & DEBUG_ERRORS)
+		sprintf(talkToHost.string(), "Error: M%d %s", gc.M, problem);
+	talkToHost.setResend(gc.LastLineNrRecieved+1);
+}
+
+// Mount the storage if it isn't yet
+bool storage_ready()
+{
+	if(storage.mounted() || storage.mount())
+		return true;
+	storage_error(STORAGE_AVAILABLE ? "no storage found" : "no storage configured (STORAGE_SD)");
+	return false;
+}
+
+// M23, M28 and M30 (deleting) need a file name and no job running from storage
+bool job_file_allowed()
+{
+	if(jobState == kJobRunning || jobState == kJobPaused || readingJob)
+	{
+		storage_error("not possible while a job runs from storage (M22 ends it)");
+		return false;
+	}
+	if(!gc.strArg[0])
+	{
+		storage_error("needs a file name in quotes");
+		return false;
+	}
+	return true;
+}
+
+// M-codes which neither touch the hardware nor depend on a standing machine,
+// or which are queued in order with the moves
+bool mCodeRunsAlongside(int mCode)
+{
+	switch(mCode)
+	{
+		case 3:
+		case 4:
+		case 5:
+		case 17:
+		case 18:
+		case 20:
+		case 21:
+		case 22:
+		case 23:
+		case 24:
+		case 25:
+		case 26:
+		case 27:
+		case 28:
+		case 29:
+		case 30:
+		case 62:
+		case 63:
+		case 84:
+		case 110:
+		case 111:
+		case 115:
+		case 141:
+		case 142:
+		case 900:
+		case 901:
+		case 902:
+		case 903:
+		case 904:
+		case 905:
+		case 906:
+		case 910:
+		case 911:
+		case 915:
+		case 916:
+			return true;
+	}
+	return false;
+}
+
+// While cutter radius compensation (G41/G42) is active, commands which change the
+// coordinate system would break the offset path
+bool compensationConflict(int gCode)
+{
+	if(sharedMachineModel.getCutterRadiusCompensation()!=0)
+	{
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "Dud G code: G%d not possible during cutter radius compensation (G40 first)", gCode);
+		talkToHost.setResend(gc.LastLineNrRecieved+1);
+		return true;
+	}
+	return false;
+}
+
+// Everything but motion and modal settings needs the compensated path up to here in the queue
+bool needsCompensationFlush()
+{
+	if((gc.seen[GCODE_M] && !mCodeRunsAlongside(gc.M)) || gc.seen[GCODE_T])
+		return true;
+	if(gc.seen[GCODE_G])
+		for(int gIndex=0; gIndex<gc.GIndex; gIndex++)
+			switch(gc.G[gIndex])
+			{
+				case 0: case 1: case 2: case 3: case 4:
+				case 40: case 41: case 42:
+				case 90: case 91: case 93: case 94:
+					break;
+				default:
+					return true;
+			}
+	return false;
+}
+
+// In inverse time mode (G93) every feed move needs its own F word
+bool inverseTimeFeedMissing(int gCode)
+{
+	if(sharedMachineModel.getInverseTimeMode() && (!gc.seen[GCODE_F] || gc.F<=0.))
+	{
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "Dud G code: G%d without F in inverse time mode", gCode);
+		talkToHost.setResend(gc.LastLineNrRecieved+1);
+		return true;
+	}
+	return false;
+}
+
+// F is the reciprocal of the move's duration in minutes. Return the feedrate which makes
+// a move of the given length (see MachineModel::feedDistance) take exactly that long.
+float inverseTimeFeedrate(float length)
+{
+	float feed = gc.F*length;
+	return MIN(feed, FAST_XY_FEEDRATE);
+}
+
+// Check line number and checksum of a command as it comes in
+bool check_transmission(GcodeParser& cmd, char instruction[])
 {
-	bool axisSelected;
-        
 	// Do we have lineNr and checksums in this gcode?
-	if((bool)(gc.seen[GCODE_CHECKSUM]) | (bool)(gc.seen[GCODE_N]))
+	if((bool)(cmd.seen[GCODE_CHECKSUM]) | (bool)(cmd.seen[GCODE_N]))
 	{
 		// Check that if recieved a L code, we also got a C code. If not, one of them has been lost, and we have to reset queue
-		if( (bool)(gc.seen[GCODE_CHECKSUM]) != (bool)(gc.seen[GCODE_N]) )
+		if( (bool)(cmd.seen[GCODE_CHECKSUM]) != (bool)(cmd.seen[GCODE_N]) )
 		{
            if(SendDebug & DEBUG_ERRORS)
            {
-              if(gc.seen[GCODE_CHECKSUM])
-                sprintf(talkToHost.string(), "Serial Error: checksum without line number. Checksum: %d, line received: %s", gc.Checksum, instruction);
+              if(cmd.seen[GCODE_CHECKSUM])
+                sprintf(talkToHost.string(), "Serial Error: checksum without line number. Checksum: %d, line received: %s", cmd.Checksum, instruction);
               else
-                sprintf(talkToHost.string(), "Serial Error: line number without checksum. Linenumber: %ld, line received: %s", gc.N, instruction);
+                sprintf(talkToHost.string(), "Serial Error: line number without checksum. Linenumber: %ld, line received: %s", cmd.N, instruction);
            }
-           talkToHost.setResend(gc.LastLineNrRecieved+1);
-           return;
+           talkToHost.setResend(lastLineNrRecieved+1);
+           return false;
 		}
 		// Check checksum of this string. Flush buffers and re-request line of error is found
-		if(gc.seen[GCODE_CHECKSUM])  // if we recieved a line nr, we know we also recieved a Checksum, so check it
+		if(cmd.seen[GCODE_CHECKSUM])  // if we recieved a line nr, we know we also recieved a Checksum, so check it
 		{
-            // Calc checksum.
-            byte checksum = 0;
-            byte count=0;
-            while(instruction[count] != '*')
-              checksum = checksum^instruction[count++];
-            // Check checksum.
-            if(gc.Checksum != (int)checksum)
+            // The checksum has been calculated as the line came in
+            if(cmd.Checksum != (int)lineChecksum)
             {
               if(SendDebug & DEBUG_ERRORS)
                 sprintf(talkToHost.string(), "Serial Error: checksum mismatch.  Remote (%d) not equal to local (%d), line received: %s", 
-                			gc.Checksum, (int)checksum, instruction);
-              talkToHost.setResend(gc.LastLineNrRecieved+1);
-              return;
+                			cmd.Checksum, (int)lineChecksum, instruction);
+              talkToHost.setResend(lastLineNrRecieved+1);
+              return false;
             }
 			// Check that this lineNr is LastLineNrRecieved+1. If not, flush
-			if(!( (bool)(gc.seen[GCODE_M]) && gc.M == 110)) // unless this is a reset-lineNr command
-				if(gc.N != gc.LastLineNrRecieved+1)
+			if(!( (bool)(cmd.seen[GCODE_M]) && cmd.M == 110)) // unless this is a reset-lineNr command
+				if(cmd.N != lastLineNrRecieved+1)
 				{
 					if(SendDebug & DEBUG_ERRORS)
-						sprintf(talkToHost.string(), "Serial Error: Linenumber (%ld) is not last + 1 (%ld), line received: %s", gc.N, gc.LastLineNrRecieved+1, instruction);
-					talkToHost.setResend(gc.LastLineNrRecieved+1);
-					return;
+						sprintf(talkToHost.string(), "Serial Error: Linenumber (%ld) is not last + 1 (%ld), line received: %s", cmd.N, lastLineNrRecieved+1, instruction);
+					talkToHost.setResend(lastLineNrRecieved+1);
+					return false;
 				}
 			//If we reach this point, communication is a succes, update our "last good line nr" and continue
-			gc.LastLineNrRecieved = gc.N;
+			lastLineNrRecieved = cmd.N;
 		}
 	}
+	cmd.LastLineNrRecieved = lastLineNrRecieved;
+	return true;
+}
 
-
+void execute_commands()
+{
+	bool axisSelected;
+	
+	// The blocks queued by this command carry its line number
+	sharedMachineModel.currentLine = gc.seen[GCODE_N] ? gc.N : -1;
+        
 	/* if no command was seen, but parameters were, then use the last G code as 
 	* the current command
 	*/
-	if ((!(gc.seen[GCODE_G] | gc.seen[GCODE_M] | gc.seen[GCODE_T])) && (seenAnything() && (last_gcode_g >= 0)))
+	if ((!(gc.seen[GCODE_G] | gc.seen[GCODE_M] | gc.seen[GCODE_T])) && (seenAnything() && !onlySpindleSpeed() && (last_gcode_g >= 0)))
 	{
 		/* yes - so use the previous command with the new parameters */
 		gc.G[0] = last_gcode_g;
+		gc.GSub[0] = 0;
 		gc.GIndex=1;
 		gc.seen[GCODE_G]=true;
 	}
@@ -390,6 +956,13 @@ void execute_commands(char instruction[])
 	// Deal with emergency stop as No 1 priority
 	if ((gc.seen[GCODE_M]) && (gc.M == 112))
 		sharedMachineModel.shutdown();
+
+	if(cutterComp.active() && needsCompensationFlush())
+		cutterComp.flush();
+	
+	// The spindle speed comes before the moves of the line. Other M-codes use S for themselves.
+	if(gc.seen[GCODE_S] && (!gc.seen[GCODE_M] || gc.M == 3 || gc.M == 4))
+		cutterComp.spindleSpeed(gc.S);
 	
 	//did we get a gcode?
 	if (gc.seen[GCODE_G])
@@ -397,10 +970,14 @@ void execute_commands(char instruction[])
 		// Handle all GCodes in this line
 		for(int gIndex=0; gIndex<gc.GIndex; gIndex++)
 		{
-			last_gcode_g = gc.G[gIndex];	/* remember this for future instructions */
+			// A drill cycle earlier on this line has to be queued completely first
+			while(pumpDrillCycle())
+				sharedMachineModel.manage(true);
+
+			/* remember motion modes for future instructions */
+			if(gc.G[gIndex]<=3 || gc.G[gIndex]==73 || (gc.G[gIndex]>=81 && gc.G[gIndex]<=89))
+				last_gcode_g = gc.G[gIndex];
 
-		    unsigned long endTime; // For Dwell
-		    
 			// Process the buffered move commands first
 			bool gCodeHandled=false;
 			switch (gc.G[gIndex])
@@ -410,18 +987,30 @@ void execute_commands(char instruction[])
 				////////////////////////
 				
 				case 0:		//Rapid move
+							if(cylindricalConflict(gc.G[gIndex]) || gearConflict(gc.G[gIndex]))
+								break;
 							fetchCartesianParameters();
 							rapidMove(fp);
 							break;
 							
 				case 1:		// Controlled move;
+							if(cylindricalConflict(gc.G[gIndex]) || gearConflict(gc.G[gIndex]))
+								break;
 							fetchCartesianParameters();
-							sharedMachineModel.qMove(fp);
+							if(inverseTimeFeedMissing(gc.G[gIndex]))
+								break;
+							if(sharedMachineModel.getInverseTimeMode())
+								fp.f = inverseTimeFeedrate(sharedMachineModel.feedDistance(fp-cutterComp.position()));
+							queueMove(fp);
 							break;
 															  
 				case 2:		// G2, Clockwise arc
 				case 3: 	// G3, Counterclockwise arc
+							if(cylindricalConflict(gc.G[gIndex]) || gearConflict(gc.G[gIndex]))
+								break;
 							fetchCartesianParameters();
+							if(inverseTimeFeedMissing(gc.G[gIndex]))
+								break;
 							if(gc.seen[GCODE_R])
 							{
 							  //drawRadius(tempX, tempY, rVal, (gc.G[gIndex]==2));
@@ -443,6 +1032,8 @@ void execute_commands(char instruction[])
 				
 							
 				case 28:	//go home.  If we send coordinates (regardless of their value) only zero those axes
+							if(cylindricalConflict(gc.G[gIndex]) || gearConflict(gc.G[gIndex]) || compensationConflict(gc.G[gIndex]))
+								break;
 							fetchCartesianParameters();
 							axisSelected = false;
 							if(gc.seen[GCODE_Z])
@@ -471,24 +1062,81 @@ void execute_commands(char instruction[])
 
 							break;							
 
-				////////////////////////
-				// Non-Buffered commands
-				////////////////////////
-							
-				case 4: 	//Dwell
-							sharedMachineModel.waitFor_qEmpty(); // Non-buffered G command. Wait till the buffer q is empty first
-							endTime = millis() + (int)(gc.P + 0.5);
-							while(millis() < endTime) 
-								sharedMachineModel.manage(true);
+				case 29:	// Probe the height map (see probeHeightMap())
+							if(cylindricalConflict(gc.G[gIndex]) || compensationConflict(gc.G[gIndex]))
+								break;
+							probeHeightMap();
 							break;
-		
-				case 20:	//Inches for Units
-							sharedMachineModel.waitFor_qEmpty(); // Non-buffered G command. Wait till the buffer q is empty first
-							sharedMachineModel.setUnits(false);
+
+				case 38:	// G38.2..G38.5 straight probe (see straightProbe())
+							if(cylindricalConflict(gc.G[gIndex]) || gearConflict(gc.G[gIndex]) || compensationConflict(gc.G[gIndex]))
+								break;
+							fetchCartesianParameters();
+							straightProbe(gc.GSub[gIndex], fp);
 							break;
-		
-				case 21:	//mm for Units
-							sharedMachineModel.waitFor_qEmpty(); // Non-buffered G command. Wait till the buffer q is empty first
+
+				case 40:	// Cutter radius compensation off
+							cutterComp.stop();
+							break;
+
+				case 41:	// Cutter radius compensation left of the path
+				case 42:	// Cutter radius compensation right of the path
+							// The diameter is taken from the tool table, tool D or the current tool (see M6)
+							if(sharedMachineModel.getCutterRadiusCompensation()!=0
+								|| (gc.seen[GCODE_D] ? (gc.D<0 || gc.D>TOOL_COUNT) : sharedMachineModel.getCurrentTool()==0))
+							{
+								if(SendDebug & DEBUG_ERRORS)
+									sprintf(talkToHost.string(), "Dud G code: G%d not possible, no tool or compensation already active", gc.G[gIndex]);
+								talkToHost.setResend(gc.LastLineNrRecieved+1);
+							}
+							else
+							{
+								float diameter = sharedMachineModel.toolDiameter(gc.seen[GCODE_D]?gc.D:sharedMachineModel.getCurrentTool());
+								if(!sharedMachineModel.getUnits())
+									diameter /= 25.4;
+								cutterComp.start((gc.G[gIndex]==41)?-1:1, diameter/2.);
+							}
+							break;
+
+				////////////////////////
+				// Non-Buffered commands
+				////////////////////////
+							
+				case 4: 	//Dwell P milliseconds (queued, the moves before it finish first)
+							cutterComp.dwell((unsigned long)(gc.P + 0.5));
+							break;
+		
+				case 7:		// G7.1 Cylindrical interpolation around A with radius R, R0 ends it
+							// (only affects moves queued from now on)
+							if(gc.GSub[gIndex]!=1 || (gc.seen[GCODE_R] && gc.R<0.))
+							{
+								if(SendDebug & DEBUG_ERRORS)
+									sprintf(talkToHost.string(), "Dud G code: G%d.%d", gc.G[gIndex], gc.GSub[gIndex]);
+								talkToHost.setResend(gc.LastLineNrRecieved+1);
+							}
+							else if(!compensationConflict(gc.G[gIndex]))
+								sharedMachineModel.setCylindricalInterpolation(gc.seen[GCODE_R]?gc.R:0.);
+							break;
+
+				case 10:	// G10 L1 P<tool> R<radius>: Set the radius of a tool in the tool table
+							if(!(gc.seen[GCODE_L] && gc.L==1 && gc.seen[GCODE_P] && gc.seen[GCODE_R])
+								|| !sharedMachineModel.setToolDiameter((int)gc.P, 2.*gc.R*(sharedMachineModel.getUnits()?1.:25.4)))
+							{
+								if(SendDebug & DEBUG_ERRORS)
+									sprintf(talkToHost.string(), "Dud G code: G%d needs L1, a tool number P and a radius R", gc.G[gIndex]);
+								talkToHost.setResend(gc.LastLineNrRecieved+1);
+							}
+							break;
+		
+				case 20:	//Inches for Units (only affects moves queued from now on)
+							if(compensationConflict(gc.G[gIndex]))
+								break;
+							sharedMachineModel.setUnits(false);
+							break;
+		
+				case 21:	//mm for Units (only affects moves queued from now on)
+							if(compensationConflict(gc.G[gIndex]))
+								break;
 							sharedMachineModel.setUnits(true);
 							break;
 							
@@ -497,8 +1145,9 @@ void execute_commands(char instruction[])
 				case 56:
 				case 57:
 				case 58:
-				case 59:	// Switch to Workin Coordinate System
-							sharedMachineModel.waitFor_qEmpty(); // Non-buffered G command. Wait till the buffer q is empty first
+				case 59:	// Switch to Workin Coordinate System (only affects moves queued from now on)
+							if(cylindricalConflict(gc.G[gIndex]) || compensationConflict(gc.G[gIndex]))
+								break;
 							if(!sharedMachineModel.switchToWCS(gc.G[gIndex]-54))
 							{
 								if(SendDebug & DEBUG_ERRORS)
@@ -512,35 +1161,39 @@ void execute_commands(char instruction[])
 				case 82:	// Drill Cycle with dwell
 				case 83:	// Drill Cycle peck drilling
 				case 85:	// Drill Cycle, slow retract
-				case 89:	// Drill Cycle with dwell and slow reredract
-							sharedMachineModel.waitFor_qEmpty(); // Non-buffered G command. Wait till the buffer q is empty first
+				case 89:	// Drill Cycle with dwell and slow reredract (queued while the next commands wait, see pumpDrillCycle())
 							fetchCartesianParameters();
 							doDrillCycle(gc.G[gIndex], fp);
 							break;
 																					
 				case 90: 	//Absolute Positioning
-							sharedMachineModel.waitFor_qEmpty(); // Non-buffered G command. Wait till the buffer q is empty first
 							sharedMachineModel.setAbsMode(true);
 							break;
 
 				case 91: 	//Incremental Positioning
-							sharedMachineModel.waitFor_qEmpty(); // Non-buffered G command. Wait till the buffer q is empty first
 							sharedMachineModel.setAbsMode(false);
 							break;
 
-				case 92:	//Set position as fp
-							sharedMachineModel.waitFor_qEmpty(); // Non-buffered G command. Wait till the buffer q is empty first
+				case 92:	//Set position as fp (only affects moves queued from now on)
+							if(cylindricalConflict(gc.G[gIndex]) || compensationConflict(gc.G[gIndex]))
+								break;
 							fetchCartesianParameters();
 							sharedMachineModel.setLocalZero(fp);
 							break;
 
+				case 93:	// Inverse time feed mode (only affects moves queued from now on)
+							sharedMachineModel.setInverseTimeMode(true);
+							break;
+
+				case 94:	// Units per minute feed mode
+							sharedMachineModel.setInverseTimeMode(false);
+							break;
+
 				case 98:	// Return to initial Z level in canned cycle
-							sharedMachineModel.waitFor_qEmpty(); // Non-buffered G command. Wait till the buffer q is empty first
 							sharedMachineModel.setRetractMode(true);
 							break;
 
 				case 99:	// Return to R level in canned cycle
-							sharedMachineModel.waitFor_qEmpty(); // Non-buffered G command. Wait till the buffer q is empty first
 							sharedMachineModel.setRetractMode(false);
 							break;
 
@@ -553,14 +1206,19 @@ void execute_commands(char instruction[])
 	}			// Gcode
 	
 	// Get feedrate if supplied and queue is empty
-	if ( gc.seen[GCODE_F] && sharedMachineModel.qEmpty())
-		sharedMachineModel.localPosition.f=MIN(gc.F, FAST_XY_FEEDRATE);
+	if ( gc.seen[GCODE_F] && !sharedMachineModel.getInverseTimeMode() && sharedMachineModel.qEmpty())
+		cutterComp.position().f=MIN(gc.F, FAST_XY_FEEDRATE);
 		
 	//find us an m code.
 	if (gc.seen[GCODE_M])
 	{
+		// A drill cycle on the same line has to be queued completely first
+		while(pumpDrillCycle())
+			sharedMachineModel.manage(true);
+
 		// Wait till the q is empty first
-		sharedMachineModel.waitFor_qEmpty();
+		if(!mCodeRunsAlongside(gc.M))
+			sharedMachineModel.waitFor_qEmpty();
 		switch (gc.M)
 		{
 			case 0:
@@ -571,8 +1229,20 @@ void execute_commands(char instruction[])
 				 break;
 			case 2:
 				 //todo: program end
+				 cutterComp.stop();		// Finishes the last move, like G40
+				 spindle.stop();
 				 break;
 				 
+			case 3:		// Spindle on, clockwise (queued, waits for the spin-up only if it wasn't running)
+				cutterComp.spindleStart(kSpindleCW);
+				break;
+			case 4:		// Spindle on, counterclockwise
+				cutterComp.spindleStart(kSpindleCCW);
+				break;
+			case 5:		// Spindle off (queued, waits for the spin-down)
+				cutterComp.spindleStart(kSpindleOff);
+				break;
+				 
 			case 6:
 				 // Tool change
 				 if(gc.seen[GCODE_T])
@@ -581,6 +1251,138 @@ void execute_commands(char instruction[])
 				 	sharedMachineModel.manualToolChange(-1);
 				 break;
 
+			case 17:	// Enable all steppers (queued)
+				sharedMachineModel.qSync(kSyncEnableSteppers);
+				break;
+
+			case 18:	// Disable all steppers (queued)
+			case 84:
+				sharedMachineModel.qSync(kSyncDisableSteppers);
+				break;
+
+			case 20:	// List the files in storage
+				if(storage_ready())
+				{
+					char name[STORAGE_NAME_SIZE];
+					long size;
+					talkToHost.informational("Begin file list");
+					for(bool found = storage.firstEntry(name, size); found; found = storage.nextEntry(name, size))
+					{
+						talkToHost.put("// ");
+						talkToHost.put(name);
+						talkToHost.put(" ");
+						talkToHost.put(size);
+						talkToHost.putEnd();
+					}
+					talkToHost.informational("End file list");
+				}
+				break;
+
+			case 21:	// Mount the storage
+				storage_ready();
+				break;
+
+			case 22:	// Release the storage
+				jobState = kJobNone;
+				storage.unmount();
+				break;
+
+			case 23:	// Select a job: M23 "NAME.NC"
+				if(job_file_allowed() && storage_ready())
+				{
+					if(storage.openRead(gc.strArg))
+					{
+						strncpy(jobName, gc.strArg, STORAGE_NAME_SIZE-1);
+						jobName[STORAGE_NAME_SIZE-1] = 0x0;
+						jobState = kJobSelected;
+						sprintf(talkToHost.string(), "File opened: %s Size: %ld", jobName, storage.size());
+					}
+					else
+					{
+						jobState = kJobNone;
+						storage_error("can't open the file");
+					}
+				}
+				break;
+
+			case 24:	// Start or resume the selected job
+				if(readingJob)
+					break;
+				if(jobState == kJobSelected || jobState == kJobPaused)
+					jobState = kJobRunning;
+				else if(jobState == kJobNone)
+					storage_error("without a selected file (M23)");
+				break;
+
+			case 25:	// Pause the job. The lines read so far still run.
+				if(jobState == kJobRunning)
+					jobState = kJobPaused;
+				break;
+
+			case 26:	// Continue the selected or paused job at byte S
+				if(jobState == kJobNone || jobState == kJobRunning || !gc.seen[GCODE_S] || !storage.seek((long)gc.S))
+					storage_error("needs a selected or paused job and a valid position S");
+				break;
+
+			case 27:	// Report the job's progress
+				if(jobState == kJobNone)
+					sprintf(talkToHost.string(), "Not running a job");
+				else
+					sprintf(talkToHost.string(), "Job: %s %s byte %ld/%ld", jobName,
+						(jobState == kJobRunning) ? "running" : ((jobState == kJobPaused) ? "paused" : "selected"),
+						storage.position(), storage.size());
+				break;
+
+			case 28:	// Upload: the following lines go into the file "NAME.NC" up to M29
+				if(job_file_allowed() && storage_ready())
+				{
+					jobState = kJobNone;
+					if(storage.openWrite(gc.strArg))
+					{
+						uploading = true;
+						sprintf(talkToHost.string(), "Writing to file: %s", gc.strArg);
+					}
+					else
+						storage_error("can't create the file");
+				}
+				break;
+
+			case 29:	// End of an upload, see process_string()
+				break;
+
+			case 30:	// Delete the file "NAME.NC". Without a name: program end, like M2
+				if(!gc.strArg[0])
+				{
+					cutterComp.stop();
+					spindle.stop();
+				}
+				else if(job_file_allowed() && storage_ready())
+				{
+					if(jobState != kJobNone && strcmp(jobName, gc.strArg) == 0)
+					{
+						jobState = kJobNone;
+						storage.close();
+					}
+					if(!storage.remove(gc.strArg))
+						storage_error("can't delete the file");
+				}
+				break;
+
+			case 62:	// Digital output P on/off with the start of the next move (or dwell)
+			case 63:
+				if(gc.seen[GCODE_P] && gc.P >= 0 && gc.P < DIGITAL_OUTPUT_COUNT)
+				{
+					// A move held back by cutter radius compensation belongs before the switch
+					cutterComp.output((byte)gc.P, gc.M == 62);
+				}
+				else
+				{
+					if(SendDebug & DEBUG_ERRORS)
+						sprintf(talkToHost.string(), "Error: M%d needs P0..P%d", gc.M, DIGITAL_OUTPUT_COUNT-1);
+					talkToHost.setResend(gc.LastLineNrRecieved+1);
+				}
+				break;
+
 			//custom code for temperature control
 //			case 104:
 //				if (gc.seen[GCODE_S])
@@ -614,11 +1416,74 @@ void execute_commands(char instruction[])
 			// Starting a new print, reset the gc.LastLineNrRecieved counter
 			case 110:
 				if (gc.seen[GCODE_N])
-					gc.LastLineNrRecieved = gc.N;
+					lastLineNrRecieved = gc.N;
 				break;
 			case 111:
 				SendDebug = gc.S;
 				break;
+			case 907:	// Laser mode: S1 on, S0 off (see Spindle.h)
+				if(!gc.seen[GCODE_S] || (gc.S != 0. && gc.S != 1.))
+				{
+					if(SendDebug & DEBUG_ERRORS)
+						sprintf(talkToHost.string(), "Error: M907 needs S0 or S1");
+					talkToHost.setResend(gc.LastLineNrRecieved+1);
+				}
+				else if(spindle.getDirection() != kSpindleOff)
+				{
+					if(SendDebug & DEBUG_ERRORS)
+						sprintf(talkToHost.string(), "Error: M907 not possible while the spindle is on (M5 first)");
+					talkToHost.setResend(gc.LastLineNrRecieved+1);
+				}
+				else
+					spindle.setLaserMode(gc.S == 1.);
+				break;
+			case 906:	// Baud rate: S<baud> switches after the ok, M906 at the new rate confirms it (see hostcom.h)
+				if(gc.seen[GCODE_S])
+				{
+					if(HostSerial::baudSupported((long)gc.S))
+						hostSerial.changeBaud((long)gc.S);
+					else
+					{
+						if(SendDebug & DEBUG_ERRORS)
+							sprintf(talkToHost.string(), "Error: M906 baud rate %ld not possible", (long)gc.S);
+						talkToHost.setResend(gc.LastLineNrRecieved+1);
+					}
+				}
+				else if(hostSerial.awaitingConfirmation())
+				{
+					hostSerial.confirmBaud();
+					EEPROM_WriteLong(EEPROM_ADR_HOST_BAUD, hostSerial.baudRate());
+					sprintf(talkToHost.string(), "Baud rate %ld stored", hostSerial.baudRate());
+				}
+				else
+					sprintf(talkToHost.string(), "Baud rate %ld", hostSerial.baudRate());
+				break;
+			case 905:	// Telemetry frames S times per second (see BinaryProtocol.h), S0 = off
+				if(gc.seen[GCODE_S] && gc.S >= 0. && gc.S <= MAX_TELEMETRY_RATE)
+					sharedMachineModel.setTelemetryRate((int)gc.S);
+				else
+				{
+					if(SendDebug & DEBUG_ERRORS)
+						sprintf(talkToHost.string(), "Error: M905 needs S0..S%d", MAX_TELEMETRY_RATE);
+					talkToHost.setResend(gc.LastLineNrRecieved+1);
+				}
+				break;
+			case 904:	// Acknowledge mode (see hostcom.h). Without echo and info messages, except for S0
+				if(gc.seen[GCODE_S] && gc.S >= kAckEach && gc.S <= kAckCumulative)
+				{
+					talkToHost.setAckMode((byte)gc.S);
+					if(gc.S == kAckEach)
+						SendDebug |= DEBUG_ECHO | DEBUG_INFO;
+					else
+						SendDebug &= ~(DEBUG_ECHO | DEBUG_INFO);
+				}
+				else
+				{
+					if(SendDebug & DEBUG_ERRORS)
+						sprintf(talkToHost.string(), "Error: M904 needs S0, S1 or S2");
+					talkToHost.setResend(gc.LastLineNrRecieved+1);
+				}
+				break;
 			case 112:	// STOP! (priority commnand)
 				sharedMachineModel.shutdown();
 				break;
@@ -671,6 +1536,73 @@ void execute_commands(char instruction[])
 				break;                                
 
 
+			case 420:	// Height map (G29): S1 on, S0 off. Without S the map is reported.
+				if(gc.seen[GCODE_S] && ((gc.S != 0. && !sharedMachineModel.absolutePositionValid) || !heightMap.enable(gc.S != 0.)))
+				{
+					if(SendDebug & DEBUG_ERRORS)
+						sprintf(talkToHost.string(), "Error: M420 S%d not possible, no height map (G29) or machine not homed", (int)gc.S);
+					talkToHost.setResend(gc.LastLineNrRecieved+1);
+				}
+				else if(!gc.seen[GCODE_S])
+					reportHeightMap();
+				break;
+
+			case 930:	// Probing cycles: edge, outside corner, bore and boss (see probingCycle())
+			case 931:
+			case 932:
+			case 933:
+				probingCycle(gc.M);
+				break;
+
+			case 910:	// Index A and/or B on the independent index channel, XYZ keep moving
+				if(gc.seen[GCODE_X] || gc.seen[GCODE_Y] || gc.seen[GCODE_Z] || !(gc.seen[GCODE_A] || gc.seen[GCODE_B])
+					|| (gc.seen[GCODE_A] && sharedMachineModel.getCylinderRadius()>0.)
+					|| (gc.seen[GCODE_A] && sharedMachineModel.getGearSlave()==kGearA)
+					|| (gc.seen[GCODE_B] && sharedMachineModel.getGearSlave()==kGearB))
+				{
+					if(SendDebug & DEBUG_ERRORS)
+						sprintf(talkToHost.string(), "Dud M code: M910 needs A and/or B only");
+					talkToHost.setResend(gc.LastLineNrRecieved+1);
+					break;
+				}
+				fetchCartesianParameters();
+				fp.f = gc.seen[GCODE_F] ? gc.F : INDEX_FEEDRATE;
+				sharedMachineModel.qIndexMove(fp);
+				break;
+
+			case 911:	// Sync point: wait until the index channel has finished
+				sharedMachineModel.waitFor_indexIdle();
+				break;
+
+			case 915:	// Electronic gearing: A or B follows X, Y or Z. E.g. M915 B3 X40 turns B by 3 degrees per 40mm on X
+				{
+					byte slave = kGearNone;
+					float slaveAmount = 0.;
+					byte master = kGearNone;
+					float masterAmount = 0.;
+					int masters = 0;
+					if(gc.seen[GCODE_A] != gc.seen[GCODE_B])
+					{
+						slave = gc.seen[GCODE_A] ? kGearA : kGearB;
+						slaveAmount = gc.seen[GCODE_A] ? gc.A : gc.B;
+					}
+					if(gc.seen[GCODE_X]) { master = kGearX; masterAmount = gc.X; masters++; }
+					if(gc.seen[GCODE_Y]) { master = kGearY; masterAmount = gc.Y; masters++; }
+					if(gc.seen[GCODE_Z]) { master = kGearZ; masterAmount = gc.Z; masters++; }
+					if(slave==kGearNone || masters!=1 || (slave==kGearA && sharedMachineModel.getCylinderRadius()>0.)
+						|| !sharedMachineModel.engageGear(slave, slaveAmount, master, masterAmount))
+					{
+						if(SendDebug & DEBUG_ERRORS)
+							sprintf(talkToHost.string(), "Dud M code: M915 needs one of A or B and one of X, Y or Z, with no more slave than master steps");
+						talkToHost.setResend(gc.LastLineNrRecieved+1);
+					}
+				}
+				break;
+
+			case 916:	// Electronic gearing off
+				sharedMachineModel.disengageGear();
+				break;
+
 			// Pleasant Mill priority commands
 			// These commands are executed, even if the machine isn't in "armed for data" mode
 			
@@ -683,19 +1615,37 @@ void execute_commands(char instruction[])
 				break;
 				
 			case 902:	// Set Device Name: The string argument is found in the commen
-				if(strlen(strArgBuffer)>0)
+				if(strlen(gc.strArg)>0)
 				{
-					strBuffer[16]=0x0;
-					EEPROM_WriteString(EEPROM_ADR_DEVICENAME, strArgBuffer);
+					gc.strArg[EEPROM_SIZE_DEVICENAME-1]=0x0;	// The tool diameters follow the device name
+					EEPROM_WriteString(EEPROM_ADR_DEVICENAME, gc.strArg);
 				}
 				else
 				{
 					if(SendDebug & DEBUG_ERRORS)
-						sprintf(talkToHost.string(), "Error: M902 not possible, bad device name argument: %s", strArgBuffer);
+						sprintf(talkToHost.string(), "Error: M902 not possible, bad device name argument: %s", gc.strArg);
 					talkToHost.setResend(gc.LastLineNrRecieved+1);
 				}
 				break;
 				
+			case 903:	// S1: Switch to the binary motion protocol (see BinaryProtocol.h). The ok tells the step resolution.
+				if(gc.seen[GCODE_S] && gc.S > 0.)
+				{
+					if(cutterComp.active() || sharedMachineModel.getCylinderRadius()>0.)
+					{
+						if(SendDebug & DEBUG_ERRORS)
+							sprintf(talkToHost.string(), "Error: M903 not possible during cutter radius compensation or cylindrical interpolation");
+						talkToHost.setResend(gc.LastLineNrRecieved+1);
+					}
+					else
+					{
+						FloatPoint u = sharedMachineModel.returnUnits();
+						sprintf(talkToHost.string(), "Binary protocol, steps per unit X:%ld Y:%ld Z:%ld A:%ld B:%ld",
+									round(u.x), round(u.y), round(u.z), round(u.a), round(u.b));
+						binaryProtocol.begin();
+					}
+				}
+				break;
 				
 			default:
 				if(SendDebug & DEBUG_ERRORS)
@@ -712,12 +1662,12 @@ void execute_commands(char instruction[])
 	}
 }
 
-bool isPriorityCommand()
+bool isPriorityCommand(GcodeParser& cmd)
 {
 	bool priority = false;
-	if(gc.seen[GCODE_M])
+	if(cmd.seen[GCODE_M])
 	{
-		switch(gc.M)
+		switch(cmd.M)
 		{
 			case 112:
 			case 900:
@@ -730,110 +1680,336 @@ bool isPriorityCommand()
 	return priority;
 }
 
-//Read the string and execute instructions
-void process_string(char instruction[], int size)
+// How a command is executed
+enum {
+	kCommandQueued,		// In order, after the ok has been sent (see execute_queued_command())
+	kCommandImmediate,	// Right away, before the commands waiting in the queue
+	kCommandAnswer		// In order, but its answer has to go into the ok, so the queue is worked off first
+};
+
+byte commandKind(GcodeParser& cmd)
 {
-	//the character / means delete block... used for comments and stuff.
-	if (instruction[0] != '/')	
+	if(cmd.seen[GCODE_M])
 	{
-		fp.x = 0.0;
-		fp.y = 0.0;
-		fp.z = 0.0;
-		fp.a = 0.0;
-		fp.b = 0.0;
-		fp.f = 0.0;
-	
-		//get all our parameters!
-		parse_string(instruction, size);
-	  
-	  
-		bool handleStandardCommands = (!sharedMachineModel.emergencyStop && sharedMachineModel.receiving);
-    	if(handleStandardCommands || isPriorityCommand())
-    	{
-			execute_commands(instruction);
-		}
-		else
+		switch(cmd.M)
 		{
-			if(SendDebug & DEBUG_ERRORS)
-                sprintf(talkToHost.string(), "Error: Machine is not armed (%s)", instruction);
-            talkToHost.setResend(gc.LastLineNrRecieved+1);
-        }
+			case 20:	// Storage and jobs: the lines from storage follow the queued commands anyway
+			case 21:
+			case 22:
+			case 23:
+			case 24:
+			case 25:
+			case 26:
+			case 27:
+			case 28:
+			case 29:
+			case 110:
+			case 111:
+			case 112:
+			case 904:
+			case 905:
+			case 906:
+				return kCommandImmediate;
+			case 30:	// Without a file name it's the program end, in order
+				return cmd.strArg[0] ? kCommandImmediate : kCommandQueued;
+			case 114:
+			case 115:
+			case 900:
+			case 901:
+			case 903:	// The frames follow the queued commands
+				return kCommandAnswer;
+		}
 	}
+	return kCommandQueued;
+}
+
+// Execute the command at the tail of the command queue. Its ok has already been
+// sent, so errors are reported as informational messages.
+void execute_queued_command()
+{
+	gc = commandQueue[commandTail];
+	commandTail = (commandTail+1)%COMMAND_QUEUE_SIZE;
+
+	fp.x = 0.0;
+	fp.y = 0.0;
+	fp.z = 0.0;
+	fp.a = 0.0;
+	fp.b = 0.0;
+	fp.f = 0.0;
+	if(gc.JobPos == kJobLineDropped)
+		return;
+	execute_commands();
+	bool failed = gc.JobPos >= 0 && talkToHost.errorPending();
+	talkToHost.sendDeferred(SendDebug & DEBUG_INFO);
+	if(failed)
+		pauseJob(gc.JobPos);
 }
 
-int scan_float(char *str, float *valp, bool seen[], unsigned int flag)
+// A job line failed. The host didn't send it, so there's nothing to resend: the job is
+// paused instead. Its lines read ahead are dropped, M24 goes on after the failed one.
+void pauseJob(long position)
 {
-	float res;
-	int len;
-	char *end;
-     
-	res = (float)strtod(str, &end);
-      
-	len = end - str;
-
-	if (len > 0)
+	if(jobState == kJobRunning)
 	{
-		*valp = res;
-		seen[flag]=true;
+		jobState = kJobPaused;
+		long next = -1;
+		for(byte i=commandTail; i!=commandHead; i=(i+1)%COMMAND_QUEUE_SIZE)
+			if(commandQueue[i].JobPos > position)
+			{
+				if(next < 0)
+					next = commandQueue[i].JobPos;
+				commandQueue[i].JobPos = kJobLineDropped;
+			}
+		if(next < 0 && readingJob && jobLineStart > position)	// Failed while this line waited for the queue
+			next = jobLineStart;
+		if(next >= 0)
+			storage.seek(next);
+		if(programControl.running() && programJobPos >= position)	// Its lines after the failed one
+			programControl.abort();
+	}
+	if(SendDebug & DEBUG_ERRORS)
+	{
+		talkToHost.put("// Job paused, the failed line starts at byte ");
+		talkToHost.put(position);
+		talkToHost.putEnd();
 	}
-	else
-		*valp = 0;
-          
-	return len;	/* length of number */
 }
 
-int scan_int(char *str, int *valp, bool seen[], unsigned int flag)
+// Queue the next line of the running subroutine or loop. Its ok has been sent with
+// the line which started it, so errors are reported as informational messages and
+// end the program. In a job, they pause it at the starting line.
+void run_program_line()
 {
-	int res;
-	int len;
-	char *end;
-
-	res = (int)strtol(str, &end, 10);
-	len = end - str;
-
-	if (len > 0)
+	const char* line = programControl.nextLine();
+	if(!line)
+		return;
+	
+	GcodeParser& cmd = commandQueue[commandHead];
+	cmd.strArg[0] = 0x0;
+	cmd.LastLineNrRecieved = lastLineNrRecieved;
+	cmd.JobPos = programJobPos;
+	
+	if(reads_parameters(line))
 	{
-		*valp = res;
-		seen[flag]=true;
+		finish_queued_commands();
+		if(!programControl.running())	// Ended by a failed job line
+			return;
+	}
+	
+	const char* error = 0;
+	if(!evaluate_line(cmd, line))
+		error = expressionError;
+	else if(oWord.keyword != kONone)
+	{
+		if(!programControl.control(oWord))
+			error = programError;
 	}
 	else
-		*valp = 0;
-          
-	return len;	/* length of number */
+		commandHead = (commandHead+1)%COMMAND_QUEUE_SIZE;
+	
+	if(error)
+	{
+		programControl.abort();
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "%s (%s)", error, line);
+		talkToHost.setResend(lastLineNrRecieved+1);
+		talkToHost.sendDeferred(true);
+		if(programJobPos >= 0)
+			pauseJob(programJobPos);
+	}
 }
 
-int scan_long(char *str, long *valp, bool seen[], unsigned int flag)
+// Work off all commands received so far, including the moves of a drill cycle
+void finish_queued_commands()
 {
-	long res;
-	int len;
-	char *end;
+	for(;;)
+	{
+		if(pumpDrillCycle())
+			sharedMachineModel.manage(true);
+		else if(!commandQueueEmpty())
+			execute_queued_command();
+		else
+			break;
+	}
+}
 
-	res = strtol(str, &end, 10);
-	len = end - str;
+// Write a line of an upload into the file, without line number and checksum
+bool write_job_line(GcodeParser& cmd, const char* instruction)
+{
+	const char* start = instruction;
+	if(cmd.seen[GCODE_N])
+	{
+		while(*start == ' ')
+			start++;
+		if(*start == 'N')
+			start++;
+		while((*start >= '0' && *start <= '9') || *start == ' ')
+			start++;
+	}
+	int length = strlen(start);
+	if(cmd.seen[GCODE_CHECKSUM])
+	{
+		const char* checksum = strrchr(start, '*');
+		if(checksum)
+			length = checksum-start;
+	}
+	if(length == 0)
+		return true;
+	if(!storage.write(start, length))
+		return false;
+	if(cmd.strArg[0])	// The string argument (comments are gone)
+	{
+		if(!storage.write(" \"", 2) || !storage.write(cmd.strArg, strlen(cmd.strArg)) || !storage.write("\"", 1))
+			return false;
+	}
+	return storage.write("\n", 1);
+}
 
-	if (len > 0)
+//Read the string, check it and queue or execute it
+void process_string(char instruction[], int size)
+{
+	//the character / means delete block... used for comments and stuff.
+	if (instruction[0] != '/')	
 	{
-		*valp = res;
-		seen[flag]=true;
+		GcodeParser& cmd = commandQueue[commandHead];	// Already parsed, see parse_char()
+
+		strncpy(cmd.strArg, strArgBuffer, STRING_BUFFER_SIZE-1);
+		cmd.strArg[STRING_BUFFER_SIZE-1] = 0x0;
+	  
+		// Line numbers in a job from storage are the job's own
+		cmd.JobPos = readingJob ? jobLineStart : -1;
+		if(readingJob)
+			cmd.LastLineNrRecieved = lastLineNrRecieved;
+		else
+		{
+			if(!check_transmission(cmd, instruction))
+				return;
+			if(cmd.seen[GCODE_N])
+				talkToHost.setAckLine(cmd.N);
+		}
+		
+		// M28 upload: the lines are written into the file up to M29
+		if(uploading)
+		{
+			if(cmd.seen[GCODE_M] && cmd.M == 29)
+			{
+				storage.close();
+				uploading = false;
+				sprintf(talkToHost.string(), "Done saving file");
+			}
+			else if(!write_job_line(cmd, instruction))
+			{
+				storage.close();
+				uploading = false;
+				if(SendDebug & DEBUG_ERRORS)
+					sprintf(talkToHost.string(), "Error: writing the file failed, upload stopped (%s)", instruction);
+				talkToHost.setResend(lastLineNrRecieved+1);
+			}
+			return;
+		}
+		
+		// The lines of a subroutine or loop are stored until its end
+		if(programControl.recording())
+		{
+			if(!programControl.record(instruction))
+			{
+				if(SendDebug & DEBUG_ERRORS)
+					sprintf(talkToHost.string(), "Error: %s (%s)", programError, instruction);
+				talkToHost.setResend(lastLineNrRecieved+1);
+			}
+			return;
+		}
+	  
+		bool handleStandardCommands = (!sharedMachineModel.emergencyStop && sharedMachineModel.receiving);
+    	if(handleStandardCommands || isPriorityCommand(cmd))
+    	{
+			// Job lines too: their parameters and O-words take effect right away, so no
+			// line before them may fail afterwards (pauseJob() can't take them back)
+			if(needsEvaluation && (readingJob || reads_parameters(instruction)))
+			{
+				finish_queued_commands();
+				if(readingJob && jobState != kJobRunning)
+					return;
+			}
+			if(needsEvaluation && !evaluate_line(cmd, instruction))
+			{
+				if(SendDebug & DEBUG_ERRORS)
+					sprintf(talkToHost.string(), "Error: %s (%s)", expressionError, instruction);
+				talkToHost.setResend(lastLineNrRecieved+1);
+				return;
+			}
+			if(oWord.keyword != kONone)
+			{
+				programJobPos = cmd.JobPos;
+				if(!programControl.begin(oWord, instruction))
+				{
+					if(SendDebug & DEBUG_ERRORS)
+						sprintf(talkToHost.string(), "Error: %s (%s)", programError, instruction);
+					talkToHost.setResend(lastLineNrRecieved+1);
+				}
+				return;
+			}
+			
+			byte kind = commandKind(cmd);
+			if(kind == kCommandAnswer)
+			{
+				finish_queued_commands();
+				if(readingJob && jobState != kJobRunning)
+					return;
+			}
+
+			if(SendDebug & DEBUG_ECHO)
+				sprintf(talkToHost.string(), "Echo: %s", instruction);
+			
+			// The program end ends a job, the lines after it aren't read
+			if(readingJob && cmd.seen[GCODE_M] && cmd.M == 30 && !cmd.strArg[0])
+				storage.seek(storage.size());
+
+			if(kind == kCommandQueued)
+				commandHead = (commandHead+1)%COMMAND_QUEUE_SIZE;
+			else
+			{
+				gc = cmd;
+				execute_commands();
+			}
+		}
+		else
+		{
+			if(SendDebug & DEBUG_ERRORS)
+                sprintf(talkToHost.string(), "Error: Machine is not armed (%s)", instruction);
+            talkToHost.setResend(lastLineNrRecieved+1);
+        }
 	}
-	else
-		*valp = 0;
-          
-	return len;	/* length of number in ascii world */
 }
 
 void setupGcodeProcessor()
 {
-  gc.LastLineNrRecieved = -1;
+  lastLineNrRecieved = -1;
   init_process_string();
 }
 
+// All moves of the program go through here, so cutter radius compensation can offset them
+void queueMove(const FloatPoint& p, bool rapid)
+{
+	if(cutterComp.active())
+	{
+		if(!cutterComp.move(p, rapid))
+		{
+			if(SendDebug & DEBUG_ERRORS)
+				sprintf(talkToHost.string(), "Error: cutter radius compensation would gouge (the path turns back inside), move skipped");
+			talkToHost.setResend(gc.LastLineNrRecieved+1);
+		}
+	}
+	else
+		sharedMachineModel.qMove(p, rapid);
+}
+
 void rapidMove(FloatPoint targetPoint)
 {
 	float fr = targetPoint.f;
 	targetPoint.f = FAST_XY_FEEDRATE;
-	sharedMachineModel.qMove(targetPoint);
-	sharedMachineModel.localPosition.f = fr;
+	queueMove(targetPoint, true);
+	cutterComp.position().f = fr;
 	targetPoint.f = fr;
 }
 
@@ -854,8 +2030,8 @@ void drawArc(float centerX, float centerY, float endpointX, float endpointY, boo
   float bY;
 
   // figure out our deltas
-  aX = sharedMachineModel.localPosition.x - centerX;
-  aY = sharedMachineModel.localPosition.y - centerY;
+  aX = cutterComp.position().x - centerX;
+  aY = cutterComp.position().y - centerY;
   bX = endpointX - centerX;
   bY = endpointY - centerY;
 
@@ -923,7 +2099,11 @@ void drawArc(float centerX, float centerY, float endpointX, float endpointY, boo
   // or the length of the curve divided by the curve section constant
   steps = (int)ceil(max(angle * 2.4, length));
 
-  FloatPoint circlePoint = sharedMachineModel.localPosition;
+  FloatPoint circlePoint = cutterComp.position();
+  if(sharedMachineModel.getInverseTimeMode())
+    circlePoint.f = inverseTimeFeedrate(length);
+  else
+    circlePoint.f = fp.f;
   
   for (s = 1; s <= steps; s++) {
     // Forwards for CCW, backwards for CW
@@ -937,12 +2117,370 @@ void drawArc(float centerX, float centerY, float endpointX, float endpointY, boo
     circlePoint.y = centerY + radius * sin(angleA + angle * ((float) step / steps));
 
     // start the move
-	sharedMachineModel.qMove(circlePoint);
+	queueMove(circlePoint);
   }
   
   // Avoid problems with rounding errors above...
-  sharedMachineModel.localPosition.x = endpointX;
-  sharedMachineModel.localPosition.y = endpointY;
+  cutterComp.position().x = endpointX;
+  cutterComp.position().y = endpointY;
+}
+
+// G29 X Y I J Q [P L R F]: Probe a grid of P by L points (3 by 3 without them), which starts at
+// X, Y (absolute, program coordinates) and is I by J in size. At each point Z goes down from
+// the clearance height R (the current Z without it) by at most Q at feedrate F, until the probe
+// touches. The map is stored and active afterwards (see HeightMap.h).
+void probeHeightMap()
+{
+	byte nx = gc.seen[GCODE_P] ? (byte)gc.P : 3;
+	byte ny = gc.seen[GCODE_L] ? (byte)gc.L : 3;
+	float mm = sharedMachineModel.getUnits() ? 1. : INCHES_TO_MM;
+	FloatPoint zero = sharedMachineModel.localZeroOffset;
+	if(!(gc.seen[GCODE_X] && gc.seen[GCODE_Y] && gc.seen[GCODE_I] && gc.seen[GCODE_J] && gc.seen[GCODE_Q]) || gc.Q <= 0.
+		|| !heightMap.setGrid((gc.X+zero.x)*mm, (gc.Y+zero.y)*mm, gc.I*mm, gc.J*mm, nx, ny))
+	{
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "Dud G code: G29 needs X, Y, I, J > 0, a depth Q > 0 and 2..%dx%d points (P, L)", MESH_MAX_POINTS_X, MESH_MAX_POINTS_Y);
+		talkToHost.setResend(gc.LastLineNrRecieved+1);
+		heightMap.load();
+		return;
+	}
+	if(!sharedMachineModel.absolutePositionValid)
+	{
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "Dud G code: G29 not possible, probably machine not homed");
+		talkToHost.setResend(gc.LastLineNrRecieved+1);
+		heightMap.load();
+		return;
+	}
+	
+	if(sharedMachineModel.probeContact())
+	{
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "Error: G29 not possible, the probe touches already");
+		talkToHost.setResend(gc.LastLineNrRecieved+1);
+		heightMap.load();
+		return;
+	}
+	
+	FloatPoint p = sharedMachineModel.localPosition;
+	float clearance = gc.seen[GCODE_R] ? gc.R : p.z;
+	float feed = gc.seen[GCODE_F] ? gc.F : PROBE_FEEDRATE/mm;
+	p.z = clearance;
+	rapidMove(p);
+	for(byte j=0; j<ny; j++)
+		for(byte k=0; k<nx; k++)
+		{
+			byte i = (j & 1) ? nx-1-k : k;	// Back and forth
+			p.x = gc.X + i*gc.I/(nx-1);
+			p.y = gc.Y + j*gc.J/(ny-1);
+			p.z = clearance;
+			rapidMove(p);
+			FloatPoint down = p;
+			down.z = clearance-gc.Q;
+			down.f = feed;
+			bool touched = sharedMachineModel.probeMove(down);
+			if(sharedMachineModel.resetState != kResetNone)
+			{
+				heightMap.load();
+				return;
+			}
+			if(!touched)
+			{
+				if(SendDebug & DEBUG_ERRORS)
+					sprintf(talkToHost.string(), "Error: G29 probe didn't touch at point %d/%d, the old height map is kept", i+1, j+1);
+				talkToHost.setResend(gc.LastLineNrRecieved+1);
+				rapidMove(p);
+				heightMap.load();
+				return;
+			}
+			heightMap.setPoint(i, j, sharedMachineModel.probeSteps.z/(float)(Z_STEPS_PER_MM));
+			rapidMove(p);
+		}
+	sharedMachineModel.waitFor_qEmpty();
+	heightMap.finish();
+}
+
+// Probed positions are reported to a thousandth
+void putProbed(const char* label, float value)
+{
+	talkToHost.put(label);
+	talkToHost.putFixed(round(value*1000.), 3);
+}
+
+// G38.2: towards the target until the probe touches, an error if it doesn't
+// G38.3: the same without the error
+// G38.4: away until the probe loses contact, an error if it doesn't
+// G38.5: the same without the error
+// The position latched by the probe interrupt goes into #5061..#5065 (#5070 = 1 if the
+// probe triggered) and to the host as "// Probe: X:.. Y:.. Z:.. A:.. B:.. S:<0|1>".
+void straightProbe(int gSub, const FloatPoint& target)
+{
+	if(gSub < 2 || gSub > 5 || sharedMachineModel.getInverseTimeMode())
+	{
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "Dud G code: G38.%d (G38.2..G38.5, not in inverse time mode)", gSub);
+		talkToHost.setResend(gc.LastLineNrRecieved+1);
+		return;
+	}
+	bool toContact = (gSub <= 3);
+	if(sharedMachineModel.probeContact() == toContact)
+	{
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "Error: G38.%d not possible, the probe %s already", gSub, toContact ? "touches" : "is free");
+		talkToHost.setResend(gc.LastLineNrRecieved+1);
+		return;
+	}
+	
+	bool triggered = sharedMachineModel.probeMove(target, toContact);
+	if(sharedMachineModel.resetState != kResetNone)
+		return;
+	FloatPoint p = triggered ? sharedMachineModel.probePosition() : sharedMachineModel.localPosition;
+	setProbeResult(p, triggered);
+	
+	talkToHost.put("// Probe:");
+	putProbed(" X:", p.x);
+	putProbed(" Y:", p.y);
+	putProbed(" Z:", p.z);
+	putProbed(" A:", p.a);
+	putProbed(" B:", p.b);
+	talkToHost.put(triggered ? " S:1" : " S:0");
+	talkToHost.putEnd();
+	
+	if(!triggered && (gSub == 2 || gSub == 4))
+	{
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "Error: G38.%d reached the target without the probe %s", gSub, toContact ? "touching" : "losing contact");
+		talkToHost.setResend(gc.LastLineNrRecieved+1);
+	}
+}
+
+// Probing cycles (M930..M933). The probe is the current tool, its diameter is taken from
+// the tool table (or the P word). F is the probing feedrate (PROBE_FEEDRATE without it).
+float cycleFeed;
+float cycleRadius;
+
+// One probe of a cycle: at most dx, dy, dz from the current position, then back there
+bool cycleProbe(int mCode, float dx, float dy, float dz, FloatPoint& contact)
+{
+	FloatPoint from = sharedMachineModel.localPosition;
+	FloatPoint target = from;
+	target.x += dx;
+	target.y += dy;
+	target.z += dz;
+	target.f = cycleFeed;
+	bool touched = !sharedMachineModel.probeContact() && sharedMachineModel.probeMove(target);
+	if(sharedMachineModel.resetState != kResetNone)
+		return false;
+	if(touched)
+		contact = sharedMachineModel.probePosition();
+	rapidMove(from);	// The same line back, away from the contact
+	if(!touched)
+	{
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "Error: M%d stopped, the probe didn't touch (or touched before it moved)", mCode);
+		talkToHost.setResend(gc.LastLineNrRecieved+1);
+	}
+	return touched;
+}
+
+// The moves between the probes: at PROBE_TRAVEL_FEEDRATE, the cycle stops where the probe touches something
+bool cycleMove(int mCode, const FloatPoint& p)
+{
+	FloatPoint target = p;
+	target.f = PROBE_TRAVEL_FEEDRATE/(sharedMachineModel.getUnits() ? 1. : INCHES_TO_MM);
+	if(!sharedMachineModel.probeContact() && !sharedMachineModel.probeMove(target))
+		return true;
+	if(sharedMachineModel.resetState == kResetNone)
+	{
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "Error: M%d stopped, the probe touched something on the way to the next probe", mCode);
+		talkToHost.setResend(gc.LastLineNrRecieved+1);
+	}
+	return false;
+}
+
+// M933: out of the boss by dx, dy, down by Q (without touching anything) and probe towards the center
+bool cycleProbeBoss(float dx, float dy, FloatPoint& contact)
+{
+	FloatPoint top = sharedMachineModel.localPosition;
+	FloatPoint out = top;
+	out.x += dx;
+	out.y += dy;
+	if(!cycleMove(933, out))
+		return false;
+	FloatPoint down = out;
+	down.z -= gc.Q;
+	down.f = cycleFeed;
+	if(sharedMachineModel.probeContact() || sharedMachineModel.probeMove(down))
+	{
+		if(sharedMachineModel.resetState == kResetNone)
+		{
+			if(SendDebug & DEBUG_ERRORS)
+				sprintf(talkToHost.string(), "Error: M933 stopped, the probe touched on the way down (R too small?)");
+			talkToHost.setResend(gc.LastLineNrRecieved+1);
+			rapidMove(out);
+		}
+		return false;
+	}
+	if(!cycleProbe(933, -dx, -dy, 0., contact))
+		return false;
+	return cycleMove(933, out) && cycleMove(933, top);
+}
+
+// M930 X|Y|Z<travel>: Edge (or top surface with Z) in the direction of the travel
+// M931 X<travel> Y<travel> Q<offset>: Outside corner. The probe starts outside both faces,
+//   goes Q along Y (towards the part) to probe the X face and Q along X to probe the Y face
+// M932 R<travel>: Center of a bore, the probe starts inside, below its top
+// M933 R<travel> Q<depth>: Center of a boss, the probe starts above it. It goes out by R,
+//   down by Q and probes back towards the center on all four sides
+// The result is the zero of the active WCS (G54..G59) on the probed axes and stored there.
+void probingCycle(int mCode)
+{
+	bool valid;
+	switch(mCode)
+	{
+		case 930:	valid = (gc.seen[GCODE_X] + gc.seen[GCODE_Y] + gc.seen[GCODE_Z] == 1); break;
+		case 931:	valid = gc.seen[GCODE_X] && gc.seen[GCODE_Y] && gc.seen[GCODE_Q] && gc.Q > 0.; break;
+		case 932:	valid = gc.seen[GCODE_R] && gc.R > 0.; break;
+		default:	valid = gc.seen[GCODE_R] && gc.R > 0. && gc.seen[GCODE_Q] && gc.Q > 0.; break;
+	}
+	if(!valid || !sharedMachineModel.absolutePositionValid || sharedMachineModel.getActiveWCS() < 0
+		|| sharedMachineModel.getCylinderRadius() > 0. || sharedMachineModel.getCutterRadiusCompensation() != 0)
+	{
+		if(SendDebug & DEBUG_ERRORS)
+			sprintf(talkToHost.string(), "Dud M code: M%d needs its words, a homed machine, G54..G59 and no G7.1/G41/G42", mCode);
+		talkToHost.setResend(gc.LastLineNrRecieved+1);
+		return;
+	}
+	
+	float mm = sharedMachineModel.getUnits() ? 1. : INCHES_TO_MM;
+	cycleFeed = gc.seen[GCODE_F] ? gc.F : PROBE_FEEDRATE/mm;
+	cycleRadius = (gc.seen[GCODE_P] ? gc.P : sharedMachineModel.toolDiameter(sharedMachineModel.getCurrentTool())/mm)/2.;
+	
+	FloatPoint start = sharedMachineModel.localPosition;
+	FloatPoint zero = start;
+	FloatPoint a, b;
+	float diameter = 0.;
+	switch(mCode)
+	{
+		case 930:
+			if(gc.seen[GCODE_Z])
+			{
+				if(!cycleProbe(mCode, 0., 0., gc.Z, a))
+					return;
+				zero.z = a.z;
+			}
+			else if(gc.seen[GCODE_X])
+			{
+				if(!cycleProbe(mCode, gc.X, 0., 0., a))
+					return;
+				zero.x = a.x + (gc.X > 0. ? cycleRadius : -cycleRadius);
+			}
+			else
+			{
+				if(!cycleProbe(mCode, 0., gc.Y, 0., a))
+					return;
+				zero.y = a.y + (gc.Y > 0. ? cycleRadius : -cycleRadius);
+			}
+			break;
+			
+		case 931:
+		{
+			float sx = (gc.X > 0.) ? 1. : -1.;
+			float sy = (gc.Y > 0.) ? 1. : -1.;
+			FloatPoint side = start;
+			side.y += sy*gc.Q;
+			if(!cycleMove(mCode, side) || !cycleProbe(mCode, gc.X, 0., 0., a) || !cycleMove(mCode, start))
+				return;
+			side = start;
+			side.x += sx*gc.Q;
+			if(!cycleMove(mCode, side) || !cycleProbe(mCode, 0., gc.Y, 0., b) || !cycleMove(mCode, start))
+				return;
+			zero.x = a.x + sx*cycleRadius;
+			zero.y = b.y + sy*cycleRadius;
+			break;
+		}
+			
+		case 932:
+			if(!cycleProbe(mCode, gc.R, 0., 0., a) || !cycleProbe(mCode, -gc.R, 0., 0., b))
+				return;
+			zero.x = (a.x+b.x)/2.;
+			diameter = a.x-b.x;
+			if(!cycleMove(mCode, zero) || !cycleProbe(mCode, 0., gc.R, 0., a) || !cycleProbe(mCode, 0., -gc.R, 0., b))
+				return;
+			zero.y = (a.y+b.y)/2.;
+			diameter = (diameter + a.y-b.y)/2. + 2.*cycleRadius;
+			if(!cycleMove(mCode, zero))
+				return;
+			break;
+			
+		case 933:
+			if(!cycleProbeBoss(gc.R, 0., a) || !cycleProbeBoss(-gc.R, 0., b))
+				return;
+			zero.x = (a.x+b.x)/2.;
+			diameter = a.x-b.x;
+			if(!cycleMove(mCode, zero) || !cycleProbeBoss(0., gc.R, a) || !cycleProbeBoss(0., -gc.R, b))
+				return;
+			zero.y = (a.y+b.y)/2.;
+			diameter = (diameter + a.y-b.y)/2. - 2.*cycleRadius;
+			if(!cycleMove(mCode, zero))
+				return;
+			break;
+	}
+	
+	sharedMachineModel.localPosition.f = start.f;
+	bool x = (mCode != 930 || gc.seen[GCODE_X]);
+	bool y = (mCode != 930 || gc.seen[GCODE_Y]);
+	bool z = (mCode == 930 && gc.seen[GCODE_Z]);
+	talkToHost.put("// M");
+	talkToHost.put(mCode);
+	talkToHost.put(" G5");
+	talkToHost.put(sharedMachineModel.getActiveWCS()+4);
+	talkToHost.put(" zero at");
+	if(x)
+		putProbed(" X:", zero.x);
+	if(y)
+		putProbed(" Y:", zero.y);
+	if(z)
+		putProbed(" Z:", zero.z);
+	if(mCode >= 932)
+		putProbed(" D:", diameter);
+	talkToHost.putEnd();
+	sharedMachineModel.setWCSZero(zero, x, y, z);
+}
+
+// M420: the heights in mm, one line per row of the grid
+void reportHeightMap()
+{
+	if(!heightMap.valid())
+	{
+		talkToHost.informational("Height map: none");
+		return;
+	}
+	talkToHost.put("// Height map: ");
+	talkToHost.put(heightMap.active() ? "on " : "off ");
+	talkToHost.put((int)heightMap.pointsX());
+	talkToHost.put("x");
+	talkToHost.put((int)heightMap.pointsY());
+	talkToHost.put(" from X:");
+	talkToHost.put(heightMap.pointX(0));
+	talkToHost.put(" Y:");
+	talkToHost.put(heightMap.pointY(0));
+	talkToHost.put(" to X:");
+	talkToHost.put(heightMap.pointX(heightMap.pointsX()-1));
+	talkToHost.put(" Y:");
+	talkToHost.put(heightMap.pointY(heightMap.pointsY()-1));
+	talkToHost.putEnd();
+	for(byte j=0; j<heightMap.pointsY(); j++)
+	{
+		talkToHost.put("//");
+		for(byte i=0; i<heightMap.pointsX(); i++)
+		{
+			talkToHost.put(" ");
+			talkToHost.putFixed(round(heightMap.point(i, j)*1000.), 3);
+		}
+		talkToHost.putEnd();
+	}
 }
 
 void doDrillCycle(int gCode, FloatPoint &fp)
@@ -1011,6 +2549,9 @@ void doDrillCycle(int gCode, FloatPoint &fp)
 				 break;
 	}
 	
+	if(sharedMachineModel.getInverseTimeMode()) // Canned cycles need a units per minute feedrate
+		error = true;
+	
 	if(error)
 	{
 		if(SendDebug & DEBUG_ERRORS)
@@ -1019,84 +2560,120 @@ void doDrillCycle(int gCode, FloatPoint &fp)
 	}
 	else
 	{
-		int loops = 1;
+		drill.loops = 1;
 		if(gc.seen[GCODE_L])
-			loops = gc.L;
+			drill.loops = gc.L;
 		if(gc.seen[GCODE_R])
 			sharedMachineModel.setRetractHeight(gc.R);
 		
-		if(fp.z<sharedMachineModel.getRetractHeight())
-		{
-			FloatPoint move = sharedMachineModel.localPosition;
-			move.z = sharedMachineModel.getRetractHeight();
-			rapidMove(move);
-			fp.z = sharedMachineModel.getRetractHeight();
-		}
-		
-		while(loops-->0)
-		{
-			rapidMove(fp);
-			if(fp.z!=sharedMachineModel.getRetractHeight())
+		drill.p = fp;
+		drill.bottom = gc.Z;
+		drill.delta = delta;
+		drill.oldZ = oldZ;
+		drill.dwell = dwell;
+		drill.slowRetract = slowRetract;
+		drill.fullRetract = fullRetract;
+		drill.stepX = (!sharedMachineModel.getAbsMode() && gc.seen[GCODE_X]) ? gc.X : 0.;
+		drill.stepY = (!sharedMachineModel.getAbsMode() && gc.seen[GCODE_Y]) ? gc.Y : 0.;
+		drill.phase = kDrillStart;
+		pumpDrillCycle();
+	}
+}
+
+// Queue the next move of the drill cycle
+void drillCycleStep()
+{
+	float retract = sharedMachineModel.getRetractHeight();
+	FloatPoint move;
+	
+	switch(drill.phase)
+	{
+		case kDrillStart:
+			drill.phase = kDrillPosition;
+			if(drill.p.z<retract)
 			{
-				fp.z = sharedMachineModel.getRetractHeight();
-				rapidMove(fp);
+				move = sharedMachineModel.localPosition;
+				move.z = retract;
+				rapidMove(move);
+				drill.p.z = retract;
 			}
+			break;
+			
+		case kDrillPosition:
+			rapidMove(drill.p);
+			drill.z = drill.p.z;
+			drill.phase = (drill.p.z!=retract) ? kDrillToR : kDrillFeed;
+			break;
 			
-			if(delta>0.)
+		case kDrillToR:
+			drill.p.z = retract;
+			drill.z = retract;
+			rapidMove(drill.p);
+			drill.phase = kDrillFeed;
+			break;
+			
+		case kDrillFeed:
+			if(drill.delta>0.)
 			{
-				float z = fp.z;
-				while(z>gc.Z)
-				{
-					z -= delta;
-					if(z<gc.Z)
-						z=gc.Z;
-
-					fp.z=z;
-					sharedMachineModel.qMove(fp);
-					
-					if(z>gc.Z)
-					{
-						if(fullRetract)
-							fp.z=sharedMachineModel.getRetractHeight();
-						else
-							fp.z=z+sharedMachineModel.getClearanceIncrement();
-						rapidMove(fp);
-						fp.z=z-.5;
-						rapidMove(fp);
-					}
-				}
+				drill.z -= drill.delta;
+				if(drill.z<drill.bottom)
+					drill.z = drill.bottom;
 			}
 			else
-			{
-				fp.z = gc.Z;
-				sharedMachineModel.qMove(fp);
-			}
+				drill.z = drill.bottom;
+			drill.p.z = drill.z;
+			sharedMachineModel.qMove(drill.p);
+			drill.phase = (drill.z>drill.bottom) ? kDrillPeckRetract : kDrillDwell;
+			break;
 			
-			if(dwell>0)
-			{
-				sharedMachineModel.waitFor_qEmpty(); // Non-buffered G command. Wait till the buffer q is empty first
-				unsigned long endTime = millis() + (int)(dwell + 0.5);
-				while(millis() < endTime) 
-					sharedMachineModel.manage(true);
-			}
-
-			if(loops==0 && sharedMachineModel.getRetractMode())
-				fp.z = oldZ;
+		case kDrillPeckRetract:
+			if(drill.fullRetract)
+				drill.p.z = retract;
 			else
-				fp.z = sharedMachineModel.getRetractHeight();
-				
-			if(slowRetract)
-				sharedMachineModel.qMove(fp);
+				drill.p.z = drill.z+sharedMachineModel.getClearanceIncrement();
+			rapidMove(drill.p);
+			drill.phase = kDrillPeckReturn;
+			break;
+			
+		case kDrillPeckReturn:
+			drill.p.z = drill.z+.5;	// Just above the depth reached so far
+			rapidMove(drill.p);
+			drill.phase = kDrillFeed;
+			break;
+			
+		case kDrillDwell:
+			if(drill.dwell>0)
+				sharedMachineModel.qDwell(drill.dwell);
+			drill.phase = kDrillRetract;
+			break;
+			
+		case kDrillRetract:
+			drill.loops--;
+			if(drill.loops==0 && sharedMachineModel.getRetractMode())
+				drill.p.z = drill.oldZ;
 			else
-				rapidMove(fp);
-
-			if(loops>0 && !sharedMachineModel.getAbsMode())
+				drill.p.z = retract;
+			if(drill.slowRetract)
+				sharedMachineModel.qMove(drill.p);
+			else
+				rapidMove(drill.p);
+			if(drill.loops>0)
 			{
-				if (gc.seen[GCODE_X])
-					fp.x += gc.X;
-				if (gc.seen[GCODE_Y])
-					fp.y += gc.Y;
+				drill.p.x += drill.stepX;
+				drill.p.y += drill.stepY;
+				drill.phase = kDrillPosition;
 			}
-		}
+			else
+				drill.phase = kDrillIdle;
+			break;
 	}
 }
+
+// Called from get_and_do_command(): Queue the moves of the current drill cycle as far as
+// the queue has room. Returns true while the cycle isn't queued completely.
+bool pumpDrillCycle()
+{
+	while(drill.phase!=kDrillIdle && !sharedMachineModel.qFull())
+		drillCycleStep();
+	return drill.phase!=kDrillIdle;
+}
@@ -30,9 +30,18 @@ boolean init_com=false;
 boolean sendData=false;
 int currentLineIndex=0;
 String linesToSend[];
-boolean waitForResponse = true;
 StringBuffer inBuffer=new StringBuffer();
 
+// Character counting: the lengths of the lines sent, but not acknowledged yet. As long as they
+// fit into the receive buffer of the mill (sent with its boot message), we don't need to wait for an ok.
+// Without a known buffer size we wait for the ok of each line.
+int rxBufferSize=0;
+ArrayList<Integer> linesInFlight=new ArrayList<Integer>();
+int charsInFlight=0;
+
+// The mill talks at 115200 baud unless another rate has been stored with M906
+int baudRate=115200;
+
 color green_ = color(30, 120, 30);
 color red_ = color(120, 30, 30);
 color bkgcolor = color(80, 80, 80);
@@ -53,7 +62,7 @@ void setup() {
   
     // text label for which comm port selected
     txtlblWhichcom = controlP5.addTextlabel("txtlblWhichcom","No Port Selected",7,28); // textlabel(name,text,x,y)
-    version = controlP5.addTextlabel("version","v0.1",5,285); // textlabel(name,text,x,y)
+    version = controlP5.addTextlabel("version","v0.2",5,285); // textlabel(name,text,x,y)
     statusline = controlP5.addTextlabel("statusline","",150,70); // textlabel(name,text,x,y)
 
     buttonChoose = controlP5.addButton("SEND", 1, 150, 39, 30, 19);
@@ -66,63 +75,84 @@ void setup() {
 
 void draw() {
   background(bkgcolor);
-  if(sendData && linesToSend!=null)
+  if(!init_com)
+    return;
+    
+  while(serial.available()>0)
   {
-    if(waitForResponse)
+    char inChar = (char)serial.readChar();
+    if(inChar=='\n')
     {
-      while(serial.available()>0)
-      {
-        char inChar = (char)serial.readChar();
-        if(inChar=='\n')
-        {
-          if(inBuffer.toString().startsWith("ok"))
-          {
-            waitForResponse=false;
-            currentLineIndex++;
-          }
-          else if(inBuffer.toString().startsWith("start"))
-          {
-            waitForResponse=false;
-            statusline.setValue("Ready");
-          }
-          else
-          {
-            statusline.setValue(inBuffer.toString());
-            sendData = false;
-            buttonChoose.setColorBackground(green_);
-            buttonAgain.setColorBackground(green_);
-            buttonAbort.setColorBackground(red_);
-            waitForResponse=false;
-          }
-          inBuffer.setLength(0);  
-          break;
-        }
-        else
-          inBuffer.append(inChar);
-      }
+      handleResponse(inBuffer.toString().trim());
+      inBuffer.setLength(0);  
     }
     else
+      inBuffer.append(inChar);
+  }
+  
+  if(sendData && linesToSend!=null)
+  {
+    while(currentLineIndex<linesToSend.length)
     {
-      if(currentLineIndex<linesToSend.length)
-      {
-        String currentLine = linesToSend[currentLineIndex];
-        statusline.setValue("Line "+currentLineIndex+": "+currentLine);
-        serial.write(currentLine);
-        serial.write(0x0d);
-        waitForResponse = true;
-      }
-      else
-      {
-        sendData = false;
-        statusline.setValue("Send complete");
-        buttonChoose.setColorBackground(green_);
-        buttonAgain.setColorBackground(green_);
-        buttonAbort.setColorBackground(red_);
-      }
+      String currentLine = linesToSend[currentLineIndex];
+      byte[] bytes = currentLine.getBytes();
+      int length = bytes.length+1; // CR, the receive buffer counts bytes
+      if(!linesInFlight.isEmpty() && charsInFlight+length>rxBufferSize)
+        break;
+      statusline.setValue("Line "+currentLineIndex+": "+currentLine);
+      serial.write(bytes);
+      serial.write(0x0d);
+      linesInFlight.add(length);
+      charsInFlight += length;
+      currentLineIndex++;
+    }
+    
+    if(currentLineIndex>=linesToSend.length && linesInFlight.isEmpty())
+    {
+      sendData = false;
+      statusline.setValue("Send complete");
+      buttonChoose.setColorBackground(green_);
+      buttonAgain.setColorBackground(green_);
+      buttonAbort.setColorBackground(red_);
     }
   }
 }
 
+void handleResponse(String response)
+{
+  // Each line gets exactly one ok (or rs/!!), errors found later are sent as "// Error" lines
+  if(response.startsWith("ok") || response.startsWith("rs") || response.startsWith("!!"))
+  {
+    if(!linesInFlight.isEmpty())
+      charsInFlight -= linesInFlight.remove(0);
+    if(response.startsWith("ok"))
+      return;
+  }
+  
+  if(response.startsWith("start") || response.startsWith("PleasantMill"))
+  {
+    // The mill has been reset, everything in flight is lost
+    int rx = response.indexOf("RX:");
+    rxBufferSize = (rx>=0) ? int(response.substring(rx+3).trim()) : 0;
+    linesInFlight.clear();
+    charsInFlight = 0;
+    if(!sendData)
+      statusline.setValue("Ready");
+  }
+  else if(response.length()==0 || response.startsWith("X-") || (response.startsWith("//") && !response.startsWith("// Error")))
+  {
+    // Capabilities (M115) and informational messages
+  }
+  else if(sendData)
+  {
+    statusline.setValue(response);
+    sendData = false;
+    buttonChoose.setColorBackground(green_);
+    buttonAgain.setColorBackground(green_);
+    buttonAbort.setColorBackground(red_);
+  }
+}
+
 public void controlEvent(ControlEvent theEvent) {
   if (theEvent.isGroup())
     if (theEvent.name()=="portComList") InitSerial(theEvent.group().value()); // initialize the serial port selected
@@ -152,7 +182,6 @@ public void SEND() {
       File file = fc.getSelectedFile(); 
       linesToSend = loadStrings(file); 
       currentLineIndex = 0;
-      waitForResponse = false;
       sendData=true;
       buttonChoose.setColorBackground(red_);
       buttonAgain.setColorBackground(red_);
@@ -165,7 +194,6 @@ public void AGAIN() {
     if(init_com && linesToSend!=null)
     {
       currentLineIndex = 0;
-      waitForResponse = false;
       sendData=true;
       buttonChoose.setColorBackground(red_);
       buttonAgain.setColorBackground(red_);
@@ -177,8 +205,9 @@ public void ABORT() {
     if(init_com && sendData)
     {
       sendData=false;
-      serial.write("M18");
-      serial.write(0x0d);
+      // Soft reset: stops the mill right away and throws away everything queued.
+      // The mill answers with its boot message, which clears linesInFlight.
+      serial.write(0x18);
       statusline.setValue("Aborted");
 
       buttonChoose.setColorBackground(green_);
@@ -205,7 +234,7 @@ String shortifyPortName(String portName, int maxlen)
 void InitSerial(float portValue) {
   String portPos = Serial.list()[int(portValue)];
   txtlblWhichcom.setValue("COM = " + shortifyPortName(portPos, 16));
-  serial = new Serial(this, portPos, 115200);
+  serial = new Serial(this, portPos, baudRate);
   init_com=true;
   buttonChoose.setColorBackground(green_);
   commListbox.setColorBackground(green_);